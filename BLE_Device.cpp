@@ -18,6 +18,8 @@
 
 #include "Arduino.h"
 #include "BLE_Device.h"
+#include "HubLog.h"
+#include <Preferences.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -64,8 +66,126 @@
 #define METERPROCO2_DATA_SIZE 16
 #define METERPROCO2_DATA_ID	'5'
 
+// Limit flash wear by saving the device table at most this often (ms). New devices are saved sooner than new readings.
+static const unsigned long newDeviceSaveDelay = 30000;
+static const unsigned long changeSaveDelay	  = 900000;
+
+// Longest time since the last advert (s) that can be restored, so millis() - LastSeen can't overflow
+static const uint32_t maxSavedAge = 2000000;
+
+bool IsEventModel( char model )
+{
+	return ( model == CONTACT_DATA_ID ) || ( model == PRESENCE_DATA_ID ) || ( model == REMOTE_DATA_ID ) || ( model == WATERLEAK_DATA_ID );
+}
+
+bool NeedsScanResponse( char model )
+{
+	switch ( model )
+	{
+		case BULB_DATA_ID:
+		case IOTH_DATA_ID:
+		case BLIND_DATA_ID:
+		case WATERLEAK_DATA_ID:
+		case METERPRO_DATA_ID:
+		case METERPROCO2_DATA_ID:
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+static int AddEvent( DEVICE_EVENT* Events, int Count, uint8_t Kind, uint32_t Value )
+{
+	if ( Count < MAX_DEVICE_EVENTS )
+	{
+		Events[ Count ].kind  = Kind;
+		Events[ Count ].value = Value;
+		Count++;
+	}
+
+	return Count;
+}
+
+// Counters that wrap, each step is one event
+static int AddCounterEvents( DEVICE_EVENT* Events, int Count, uint8_t Kind, uint8_t Old, uint8_t New, uint8_t Mask )
+{
+	uint8_t steps = ( New - Old ) & Mask;
+	for ( uint8_t i = 1; i <= steps; i++ )
+	{
+		Count = AddEvent( Events, Count, Kind, ( Old + i ) & Mask );
+	}
+
+	return Count;
+}
+
+int FindDeviceEvents( const SWITCHBOT& Old, const SWITCHBOT& New, DEVICE_EVENT* Events )
+{
+	int count = 0;
+
+	if ( Old.model != New.model )
+	{
+		return 0;
+	}
+
+	switch ( New.model )
+	{
+		case PRESENCE_DATA_ID:
+			if ( Old.Presence.motion != New.Presence.motion )
+			{
+				count = AddEvent( Events, count, EVENT_MOTION, New.Presence.motion );
+			}
+			if ( Old.Presence.light != New.Presence.light )
+			{
+				count = AddEvent( Events, count, EVENT_LIGHT, New.Presence.light );
+			}
+			break;
+
+		case CONTACT_DATA_ID:
+			if ( Old.Contact.contact != New.Contact.contact )
+			{
+				count = AddEvent( Events, count, EVENT_CONTACT, New.Contact.contact );
+			}
+			if ( Old.Contact.motion != New.Contact.motion )
+			{
+				count = AddEvent( Events, count, EVENT_MOTION, New.Contact.motion );
+			}
+			if ( Old.Contact.light != New.Contact.light )
+			{
+				count = AddEvent( Events, count, EVENT_LIGHT, New.Contact.light );
+			}
+			count = AddCounterEvents( Events, count, EVENT_BUTTON, Old.Contact.buttonPresses, New.Contact.buttonPresses, 0x0F );
+			count = AddCounterEvents( Events, count, EVENT_ENTRY, Old.Contact.entryCount, New.Contact.entryCount, 0x03 );
+			count = AddCounterEvents( Events, count, EVENT_EXIT, Old.Contact.exitCount, New.Contact.exitCount, 0x03 );
+			break;
+
+		case REMOTE_DATA_ID:
+			if ( ( Old.Remote.data1 != New.Remote.data1 ) || ( Old.Remote.data2 != New.Remote.data2 ) || ( Old.Remote.data3 != New.Remote.data3 ) )
+			{
+				count = AddEvent( Events, count, EVENT_REMOTE, ( New.Remote.data1 << 16 ) | ( New.Remote.data2 << 8 ) | New.Remote.data3 );
+			}
+			break;
+
+		case WATERLEAK_DATA_ID:
+			if ( Old.WaterLeak.status != New.WaterLeak.status )
+			{
+				count = AddEvent( Events, count, EVENT_LEAK, New.WaterLeak.status );
+			}
+			break;
+	}
+
+	return count;
+}
+
+const char* GetEventName( uint8_t Kind )
+{
+	static const char* const names[ NUM_EVENT_KINDS ] = { "motion", "contact", "light", "button", "entry", "exit", "leak", "remote" };
+	return ( Kind < NUM_EVENT_KINDS ) ? names[ Kind ] : "unknown";
+}
+
 void printHex( uint8_t* data, uint8_t len )
 {
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
 	char buf[ 100 ];
 	int dataSize = 0;
 	for ( uint8_t i = 0; ( i < len ) && ( dataSize < 94 ); i++ )
@@ -75,7 +195,8 @@ void printHex( uint8_t* data, uint8_t len )
 
 	buf[ dataSize ] = 0;
 
-	Serial.println( buf );
+	LOG_DEBUG( "%s", buf );
+#endif
 }
 
 bool ValidateData( uint8_t Type, uint8_t* BLEData, uint16_t BLEDataSize, uint8_t* ManufactureData, uint16_t ManufactureDataSize )
@@ -206,13 +327,13 @@ bool ValidateData( uint8_t Type, uint8_t* BLEData, uint16_t BLEDataSize, uint8_t
 					return false;
 			}
 
-			Serial.printf( "Invalid %c BLE data: expect size = %i, size = %i\n",
+			LOG_DEBUG( "Invalid %c BLE data: expect size = %i, size = %i",
 						   Type, expected_size, BLEDataSize );
 			printHex( BLEData, BLEDataSize );
 			return false;
 	}
 
-	Serial.printf( "Invalid %c Manufacture data: expect size = %i, size = %i\n",
+	LOG_DEBUG( "Invalid %c Manufacture data: expect size = %i, size = %i",
 				   Type, expected_size, ManufactureDataSize );
 	printHex( ManufactureData, ManufactureDataSize );
 	return false;
@@ -238,8 +359,13 @@ BLE_Device::BLE_Device()
 {
 	NumDevices = 0;
 	Changed	   = false;
+	ChangeSeq  = 0;
+	JsonMutex  = xSemaphoreCreateRecursiveMutex();
+	Persist	   = false;
+	SaveDue	   = 0;
+	Saves	   = 0;
 
-	memset( BLE_devices, 0, sizeof( BLE_DEVICE ) * 50 );
+	memset( BLE_devices, 0, sizeof( BLE_DEVICE ) * MAX_DEVICES );
 	// Serial.println( "BLE Device Class initialised" );
 }
 
@@ -247,11 +373,137 @@ BLE_Device::~BLE_Device()
 {
 }
 
+void BLE_Device::Begin( bool persist )
+{
+	Persist = persist;
+	if ( !Persist )
+	{
+		return;
+	}
+
+	SAVED_DEVICE* saved = ( SAVED_DEVICE* ) malloc( sizeof( SAVED_DEVICE ) * MAX_DEVICES );
+	if ( saved == nullptr )
+	{
+		return;
+	}
+
+	Preferences prefs;
+	if ( prefs.begin( "devices", true ) )
+	{
+		size_t bytes = prefs.getBytesLength( "table" );
+		if ( ( bytes > 0 ) && ( bytes <= ( sizeof( SAVED_DEVICE ) * MAX_DEVICES ) ) && ( ( bytes % sizeof( SAVED_DEVICE ) ) == 0 ) )
+		{
+			prefs.getBytes( "table", saved, bytes );
+			for ( size_t i = 0; i < ( bytes / sizeof( SAVED_DEVICE ) ); i++ )
+			{
+				if ( ( saved[ i ].MAC[ 0 ] == 0 ) || ( saved[ i ].DataSize == 0 ) || ( saved[ i ].DataSize > sizeof( saved[ i ].Data ) ) )
+				{
+					continue;
+				}
+
+				BLE_DEVICE& device = BLE_devices[ NumDevices++ ];
+				strlcpy( device.MAC, saved[ i ].MAC, sizeof( device.MAC ) );
+				device.AddrType = saved[ i ].AddrType;
+				device.rssi		= saved[ i ].rssi;
+				device.DataSize = saved[ i ].DataSize;
+				memcpy( device.Data, saved[ i ].Data, saved[ i ].DataSize );
+				device.Seq		= ++ChangeSeq;
+				device.LastSeen = 0 - ( ( ( saved[ i ].Age < maxSavedAge ) ? saved[ i ].Age : maxSavedAge ) * 1000UL );	  // Ignores the time the hub was off
+				device.Stale	= true;
+			}
+
+			LOG_INFO( "Restored %i devices", NumDevices );
+		}
+
+		prefs.end();
+	}
+
+	free( saved );
+}
+
+// Adding a device is saved soon, new readings can wait longer
+void BLE_Device::ScheduleSave( unsigned long Delay )
+{
+	unsigned long due = millis() + Delay;
+	if ( due == 0 )
+	{
+		due = 1;
+	}
+
+	if ( ( SaveDue == 0 ) || ( ( long ) ( due - SaveDue ) < 0 ) )
+	{
+		SaveDue = due;
+	}
+}
+
+// The table is held until the save is written, so a forced save before a reboot waits for one in progress
+bool BLE_Device::SaveIfDue( unsigned long t, bool Force )
+{
+	if ( !Persist || ( SaveDue == 0 ) )
+	{
+		return false;
+	}
+
+	xSemaphoreTakeRecursive( JsonMutex, portMAX_DELAY );
+
+	if ( ( SaveDue == 0 ) || ( !Force && ( ( long ) ( t - SaveDue ) < 0 ) ) )
+	{
+		xSemaphoreGiveRecursive( JsonMutex );
+		return false;
+	}
+
+	SAVED_DEVICE* saved = ( SAVED_DEVICE* ) malloc( sizeof( SAVED_DEVICE ) * MAX_DEVICES );
+	if ( saved == nullptr )
+	{
+		xSemaphoreGiveRecursive( JsonMutex );
+		return false;	 // Try again next time
+	}
+
+	uint8_t numDevices = NumDevices;
+	memset( saved, 0, sizeof( SAVED_DEVICE ) * numDevices );
+	for ( uint8_t i = 0; i < numDevices; i++ )
+	{
+		strlcpy( saved[ i ].MAC, BLE_devices[ i ].MAC, sizeof( saved[ i ].MAC ) );
+		saved[ i ].AddrType = BLE_devices[ i ].AddrType;
+		saved[ i ].rssi		= BLE_devices[ i ].rssi;
+		saved[ i ].DataSize = BLE_devices[ i ].DataSize;
+		memcpy( saved[ i ].Data, BLE_devices[ i ].Data, sizeof( saved[ i ].Data ) );
+		saved[ i ].Age		= ( t - BLE_devices[ i ].LastSeen ) / 1000;
+	}
+
+	SaveDue = 0;
+
+	Preferences prefs;
+	if ( prefs.begin( "devices", false ) )
+	{
+		prefs.putBytes( "table", saved, sizeof( SAVED_DEVICE ) * numDevices );
+		prefs.end();
+		Saves++;
+	}
+
+	xSemaphoreGiveRecursive( JsonMutex );
+	free( saved );
+	return true;
+}
+
 bool BLE_Device::HasChanged()
 {
 	return Changed;
 }
 
+bool BLE_Device::HasEventChange()
+{
+	for ( uint8_t i = 0; i < NumDevices; i++ )
+	{
+		if ( BLE_devices[ i ].Changed && IsEventModel( BLE_devices[ i ].Data[ 0 ] ) )
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
 int BLE_Device::FindDevice( const char* MAC )
 {
 	for ( uint8_t i = 0; i < NumDevices; i++ )
@@ -267,7 +519,7 @@ int BLE_Device::FindDevice( const char* MAC )
 	return -1;
 }
 
-bool BLE_Device::AddDevice( const char* MAC, int rssi, uint8_t* BLEData,
+AdvertResult BLE_Device::AddDevice( const char* MAC, uint8_t AddrType, int rssi, uint8_t* BLEData,
 							uint8_t BLEDataSize, uint8_t* ManufactureData,
 							uint8_t ManufactureDataSize )
 {
@@ -275,37 +527,47 @@ bool BLE_Device::AddDevice( const char* MAC, int rssi, uint8_t* BLEData,
 						ManufactureDataSize ) )
 	{
 		// Wrong type or wrong data size
-		return false;
+		return ADVERT_INVALID;
 	}
 
+	xSemaphoreTakeRecursive( JsonMutex, portMAX_DELAY );
+
 	int i = FindDevice( MAC );
 
 	if ( i >= 0 )
 	{
 		// Device already in the array so just update it
-		if ( CompareDevice( i, rssi, BLEData, BLEDataSize, ManufactureData,
-							ManufactureDataSize ) )
+		BLE_devices[ i ].AddrType = AddrType;
+		BLE_devices[ i ].LastSeen = millis();
+
+		// A restored device is always updated so it is no longer stale
+		if ( !BLE_devices[ i ].Stale && CompareDevice( i, rssi, BLEData, BLEDataSize, ManufactureData,
+													   ManufactureDataSize ) )
 		{
 			// They are the same
 			//            Serial.printf( "Matched %s\n", MAC );
-			return true;
+			xSemaphoreGiveRecursive( JsonMutex );
+			return ADVERT_UNCHANGED;
 		}
 
 		// Update the existing device
 		UpdateDevice( i, rssi, BLEData, BLEDataSize, ManufactureData,
 					  ManufactureDataSize );
-		return true;
+		xSemaphoreGiveRecursive( JsonMutex );
+		return ADVERT_CHANGED;
 	}
 
-	if ( NumDevices >= 50 )
+	if ( NumDevices >= MAX_DEVICES )
 	{
-		return false;
+		xSemaphoreGiveRecursive( JsonMutex );
+		return ADVERT_NO_ROOM;
 	}
 
 	// Serial.printf( "Added %s @ %i\n", MAC, NumDevices );
 
 	strcpy( BLE_devices[ NumDevices ].MAC, MAC );
 	strupr( BLE_devices[ NumDevices ].MAC );
+	BLE_devices[ NumDevices ].AddrType = AddrType;
 
 	switch ( BLEData[ 0 ] )
 	{
@@ -367,16 +629,22 @@ bool BLE_Device::AddDevice( const char* MAC, int rssi, uint8_t* BLEData,
 		}
 	}
 
-	BLE_devices[ NumDevices ].Changed = true;
-	BLE_devices[ NumDevices ].rssi	  = rssi;
+	BLE_devices[ NumDevices ].Changed	  = true;
+	BLE_devices[ NumDevices ].ChangedTime = millis();
+	BLE_devices[ NumDevices ].rssi		  = rssi;
+	BLE_devices[ NumDevices ].Seq		  = ++ChangeSeq;
+	BLE_devices[ NumDevices ].LastSeen	  = millis();
+	BLE_devices[ NumDevices ].Stale		  = false;
 
 	// Serial.printf("Added %s @ %i = %c\n",  BLE_devices[ NumDevices ].MAC,
 	// NumDevices, BLEData[ 0 ] );
 
 	Changed = true;
 	NumDevices++;
+	ScheduleSave( newDeviceSaveDelay );
 
-	return true;
+	xSemaphoreGiveRecursive( JsonMutex );
+	return ADVERT_ADDED;
 }
 
 // Return true if the device data is the same
@@ -528,6 +796,8 @@ void BLE_Device::UpdateDevice( uint8_t Index, int rssi, uint8_t* BLEData,
 		return;
 	}
 
+	xSemaphoreTakeRecursive( JsonMutex, portMAX_DELAY );
+
 	switch ( BLEData[ 0 ] )
 	{
 		case BULB_DATA_ID:
@@ -553,9 +823,19 @@ void BLE_Device::UpdateDevice( uint8_t Index, int rssi, uint8_t* BLEData,
 		}
 	}
 
+	if ( !BLE_devices[ Index ].Changed )
+	{
+		BLE_devices[ Index ].ChangedTime = millis();
+	}
+
 	BLE_devices[ Index ].Changed = true;
 	BLE_devices[ Index ].rssi	 = rssi;
+	BLE_devices[ Index ].Seq	 = ++ChangeSeq;
+	BLE_devices[ Index ].Stale	 = false;
 	Changed						 = true;
+	ScheduleSave( changeSaveDelay );
+
+	xSemaphoreGiveRecursive( JsonMutex );
 
 	// Serial.printf( "Updated %s @ %i = %c\n", BLE_devices[ Index ].MAC, Index, BLEData[ 0 ] );
 	// printHex( BLE_devices[ Index ].Data, BLE_devices[ Index ].DataSize );
@@ -564,15 +844,35 @@ void BLE_Device::UpdateDevice( uint8_t Index, int rssi, uint8_t* BLEData,
 // Returns false if Index is beyond the last entry
 bool BLE_Device::GetSWDevice( uint8_t Index, SWITCHBOT& Device )
 {
+	bool found = false;
+
+	xSemaphoreTakeRecursive( JsonMutex, portMAX_DELAY );
 	if ( Index < NumDevices )
 	{
 		if ( !parseDevice( BLE_devices[ Index ], Device ) )
 		{
-			Serial.printf( "Failed to parse device %i\n", Index );
+			LOG_ERROR( "Failed to parse device %i", Index );
 		}
-		return true;
+		found = true;
 	}
-	return false;
+	xSemaphoreGiveRecursive( JsonMutex );
+
+	return found;
+}
+
+bool BLE_Device::IsStale( uint8_t Index )
+{
+	return ( Index < NumDevices ) && BLE_devices[ Index ].Stale;
+}
+
+uint8_t BLE_Device::GetAddressType( uint8_t Index )
+{
+	if ( Index < NumDevices )
+	{
+		return BLE_devices[ Index ].AddrType;
+	}
+
+	return 0;
 }
 
 int BLE_Device::DeviceToJson( uint8_t Index, char* Buf, int BufSize,
@@ -581,10 +881,21 @@ int BLE_Device::DeviceToJson( uint8_t Index, char* Buf, int BufSize,
 	SWITCHBOT Device;
 	if ( GetSWDevice( Index, Device ) )
 	{
+		// A restored device says how old its data is, at least
+		char stale[ 40 ] = "";
+		if ( BLE_devices[ Index ].Stale )
+		{
+			snprintf( stale, sizeof( stale ), "\"stale\":true,\"age\":%lu,", ( millis() - BLE_devices[ Index ].LastSeen ) / 1000 );
+		}
+
 		int bytes = snprintf( Buf, BufSize,
 							  "{\"hubMAC\":\"%s\",\"address\":\"%s\",\"rssi\":%"
-							  "i,\"serviceData\":",
-							  macAddress, Device.MAC, Device.rssi );
+							  "i,%s\"serviceData\":",
+							  macAddress, Device.MAC, Device.rssi, stale );
+		if ( bytes >= BufSize )
+		{
+			return bytes;	 // Truncated, the caller sees it didn't fit
+		}
 
 		switch ( Device.model )
 		{
@@ -769,16 +1080,11 @@ int BLE_Device::DeviceToJson( uint8_t Index, char* Buf, int BufSize,
 		macAddress, Index );
 }
 
+// With OnlyChanged the event devices are left for TakeChangedEvents
 int BLE_Device::AllToJson( char* Buf, int BufSize, bool OnlyChanged,
-						   char* macAddress )
+						   char* macAddress, DeviceReportCheck ShouldReport )
 {
-	static boolean inAllToJson = false;
-
-	while ( inAllToJson )
-	{
-	};
-
-	inAllToJson = true;
+	xSemaphoreTakeRecursive( JsonMutex, portMAX_DELAY );
 
 	if ( OnlyChanged )
 	{
@@ -796,12 +1102,17 @@ int BLE_Device::AllToJson( char* Buf, int BufSize, bool OnlyChanged,
 
 		if ( OnlyChanged )
 		{
-			if ( !BLE_devices[ i ].Changed )
+			if ( !BLE_devices[ i ].Changed || IsEventModel( BLE_devices[ i ].Data[ 0 ] ) )
 			{
 				continue;
 			}
 
 			BLE_devices[ i ].Changed = false;
+
+			if ( ( ShouldReport != nullptr ) && !ShouldReport( i ) )
+			{
+				continue;
+			}
 		}
 
 		int bytes = DeviceToJson( i, Buf + totaleBytes, BufSize - totaleBytes,
@@ -817,7 +1128,7 @@ int BLE_Device::AllToJson( char* Buf, int BufSize, bool OnlyChanged,
 	{
 		Buf[ 1 ] = ']';
 		Buf[ 2 ] = 0;
-		inAllToJson = false;
+		xSemaphoreGiveRecursive( JsonMutex );
 		return 0;
 	}
 
@@ -827,10 +1138,97 @@ int BLE_Device::AllToJson( char* Buf, int BufSize, bool OnlyChanged,
 
 	// Serial.println( Buf );
 
-	inAllToJson = false;
+	xSemaphoreGiveRecursive( JsonMutex );
 	return totaleBytes;
 }
 
+int BLE_Device::TakeChangedEvents( uint8_t* Indexes, int Max, unsigned long* Oldest )
+{
+	int count			 = 0;
+	unsigned long oldest = millis();
+
+	xSemaphoreTakeRecursive( JsonMutex, portMAX_DELAY );
+	for ( uint8_t i = 0; ( i < NumDevices ) && ( count < Max ); i++ )
+	{
+		if ( BLE_devices[ i ].Changed && IsEventModel( BLE_devices[ i ].Data[ 0 ] ) )
+		{
+			BLE_devices[ i ].Changed = false;
+			if ( ( long ) ( BLE_devices[ i ].ChangedTime - oldest ) < 0 )
+			{
+				oldest = BLE_devices[ i ].ChangedTime;
+			}
+
+			Indexes[ count++ ] = i;
+		}
+	}
+	xSemaphoreGiveRecursive( JsonMutex );
+
+	*Oldest = oldest;
+	return count;
+}
+
+void BLE_Device::MarkChanged( uint8_t Index )
+{
+	xSemaphoreTakeRecursive( JsonMutex, portMAX_DELAY );
+	if ( Index < NumDevices )
+	{
+		// Keeps the time of the first change, unless it changed again since it was taken
+		BLE_devices[ Index ].Changed = true;
+		Changed						 = true;
+	}
+	xSemaphoreGiveRecursive( JsonMutex );
+}
+
+// Only the devices that changed after Since and match the model and MAC filters. Returns -1 if they didn't all fit,
+// Buf then holds the ones that did.
+int BLE_Device::FilteredToJson( char* Buf, int BufSize, uint32_t Since, char Model,
+								const char* MAC, char* macAddress )
+{
+	bool complete	= true;
+	int totaleBytes = 1;
+	*Buf			= '[';
+
+	xSemaphoreTakeRecursive( JsonMutex, portMAX_DELAY );
+	for ( uint8_t i = 0; i < NumDevices; i++ )
+	{
+		if ( ( BLE_devices[ i ].Seq <= Since ) ||
+			 ( ( Model != 0 ) && ( BLE_devices[ i ].Data[ 0 ] != Model ) ) ||
+			 ( ( MAC != nullptr ) && ( strcasecmp( BLE_devices[ i ].MAC, MAC ) != 0 ) ) )
+		{
+			continue;
+		}
+
+		// Room is kept for the comma, which becomes the closing bracket after the last device
+		int room  = BufSize - totaleBytes - 1;
+		int bytes = DeviceToJson( i, Buf + totaleBytes, room, macAddress );
+		if ( bytes >= room )
+		{
+			complete = false;
+			break;
+		}
+
+		if ( bytes > 0 )
+		{
+			totaleBytes += bytes;
+			Buf[ totaleBytes++ ] = ',';
+		}
+	}
+	xSemaphoreGiveRecursive( JsonMutex );
+
+	if ( totaleBytes < 3 )
+	{
+		Buf[ 1 ] = ']';
+		Buf[ 2 ] = 0;
+		return complete ? 0 : -1;
+	}
+
+	totaleBytes--;
+	Buf[ totaleBytes++ ] = ']';
+	Buf[ totaleBytes ]	 = 0;
+
+	return complete ? totaleBytes : -1;
+}
+
 void BLE_Device::ClearChanged()
 {
 	for ( uint8_t i = 0; i < NumDevices; i++ )
@@ -851,7 +1249,7 @@ bool BLE_Device::parseDevice( BLE_DEVICE& Device, SWITCHBOT& SW_Device )
 
 	if ( Device.DataSize < 3 )
 	{
-		Serial.println( "Failed to parse device: Datasize < 3" );
+		LOG_ERROR( "Failed to parse device: Datasize < 3" );
 		return false;
 	}
 
@@ -924,7 +1322,7 @@ bool BLE_Device::parseDevice( BLE_DEVICE& Device, SWITCHBOT& SW_Device )
 		}
 	}
 
-	Serial.println( "Failed to parse device: Unrecognised device type" );
+	LOG_ERROR( "Failed to parse device: Unrecognised device type" );
 	return false;
 }
 
@@ -984,7 +1382,7 @@ bool BLE_Device::parseBlind( BLE_DEVICE& Device, SWITCHBOT& SW_Device )
 	if ( ( Device.DataSize != BLIND_DATASIZE ) &&
 		 ( Device.DataSize != BLIND_DATASIZE2 ) )
 	{
-		Serial.printf( "Failed to parse Blind: MAC = %s, data size = %i\n",
+		LOG_ERROR( "Failed to parse Blind: MAC = %s, data size = %i",
 					   Device.MAC, Device.DataSize );
 		return false;
 	}
@@ -1269,12 +1667,27 @@ ClientCallbacks::ClientCallbacks()
 {
 	memset( Callbacks, 0, 5 );
 	NumCallbacks = 0;
+	Mutex		 = xSemaphoreCreateMutex();
 }
 
 ClientCallbacks::~ClientCallbacks()
 {
 }
 
+// Call with the mutex held
+int ClientCallbacks::FindIndex( const char* url )
+{
+	for ( uint8_t i = 0; i < NumCallbacks; i++ )
+	{
+		if ( strcmp( Callbacks[ i ].url, url ) == 0 )
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
 bool ClientCallbacks::Add( const char* url, unsigned long t )
 {
 	if ( ( url == nullptr ) || ( *url == 0 ) )
@@ -1285,25 +1698,35 @@ bool ClientCallbacks::Add( const char* url, unsigned long t )
 
 	// Serial.printf( "Request to add: %s\n", url );
 
-	for ( uint8_t i = 0; i < NumCallbacks; i++ )
+	bool added = true;
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+
+	int i = FindIndex( url );
+	if ( i >= 0 )
 	{
-		if ( strcmp( Callbacks[ i ].url, url ) == 0 )
-		{
-			Callbacks[ i ].activatedTime = t;
-			Callbacks[ i ].refusals		 = 0;
-			// Serial.println( "Request OK, URI is already registered." );
-			return true;
-		}
+		Callbacks[ i ].activatedTime = t;
+		Callbacks[ i ].refusals		 = 0;
+		// Serial.println( "Request OK, URI is already registered." );
 	}
+	else if ( NumCallbacks < ( int ) ( sizeof( Callbacks ) / sizeof( Callbacks[ 0 ] ) ) )
+	{
+		Callbacks[ NumCallbacks ].activatedTime = t;
+		Callbacks[ NumCallbacks ].refusals		= 0;
+		strncpy( Callbacks[ NumCallbacks ].url, url, sizeof( Callbacks[ 0 ].url ) - 1 );
+		Callbacks[ NumCallbacks ].url[ sizeof( Callbacks[ 0 ].url ) - 1 ] = 0;
+		NumCallbacks++;
 
-	Callbacks[ NumCallbacks ].activatedTime = t;
-	Callbacks[ NumCallbacks ].refusals		= 0;
-	strcpy( Callbacks[ NumCallbacks ].url, url );
-	NumCallbacks++;
+		// Serial.printf( "Request OK, URI %s has been added.\n", url );
+	}
+	else
+	{
+		LOG_WARN( "No room for client %s", url );
+		added = false;
+	}
 
-	// Serial.printf( "Request OK, URI %s has been added.\n", url );
+	xSemaphoreGive( Mutex );
 
-	return true;
+	return added;
 }
 
 bool ClientCallbacks::Find( const char* base_url, char* full_url, int bufSize )
@@ -1313,38 +1736,48 @@ bool ClientCallbacks::Find( const char* base_url, char* full_url, int bufSize )
 		return false;
 	}
 
+	bool found = false;
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+
 	for ( uint8_t i = 0; i < NumCallbacks; i++ )
 	{
 		if ( strstr( Callbacks[ i ].url, base_url ) != nullptr )
 		{
 			strncpy( full_url, Callbacks[ i ].url, bufSize );
-			return true;
+			found = true;
+			break;
 		}
 	}
 
-	return false;
+	xSemaphoreGive( Mutex );
+	return found;
 }
 
 bool ClientCallbacks::Get( uint8_t Index, char* buf, int BufLength )
 {
+	bool found = false;
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+
 	if ( Index < NumCallbacks )
 	{
 		strncpy( buf, Callbacks[ Index ].url, BufLength );
-		return true;
+		found = true;
 	}
 
-	return false;
+	xSemaphoreGive( Mutex );
+	return found;
 }
 
-bool ClientCallbacks::Remove( uint8_t Index )
+// Call with the mutex held
+void ClientCallbacks::RemoveAt( uint8_t Index )
 {
   if (Callbacks[ Index ].refusals > 10)
   {
-    Serial.printf( "Removing client %s as too many contiguous refusals\n", Callbacks[ Index ].url );
+    LOG_WARN( "Removing client %s as too many contiguous refusals", Callbacks[ Index ].url );
   }
   else
   {
-    Serial.printf( "Removing expired client %s\n", Callbacks[ Index ].url );
+    LOG_WARN( "Removing expired client %s", Callbacks[ Index ].url );
   }
 
 	for ( int8_t x = Index; x < NumCallbacks - 1; x++ )
@@ -1362,39 +1795,60 @@ bool ClientCallbacks::Remove( const char* url )
 		return false;
 	}
 
-	for ( uint8_t i = 0; i < NumCallbacks; i++ )
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+
+	// Search for the entry
+	int i = FindIndex( url );
+	if ( i >= 0 )
 	{
-		// Search for the entry
-		if ( strcmp( Callbacks[ i ].url, url ) == 0 )
-		{
-			// Found it so remove it.
-			return Remove( i );
-		}
+		// Found it so remove it.
+		RemoveAt( i );
 	}
 
-	return false;
+	xSemaphoreGive( Mutex );
+	return i >= 0;
 }
 
-void ClientCallbacks::addRefusal( uint8_t Index )
+void ClientCallbacks::addRefusal( const char* url )
 {
-	Callbacks[ Index ].refusals++;
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+
+	int i = FindIndex( url );
+	if ( i >= 0 )
+	{
+		Callbacks[ i ].refusals++;
+	}
+
+	xSemaphoreGive( Mutex );
 }
 
-void ClientCallbacks::resetRefusal( uint8_t Index )
+void ClientCallbacks::resetRefusal( const char* url )
 {
-	Callbacks[ Index ].refusals = 0;
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+
+	int i = FindIndex( url );
+	if ( i >= 0 )
+	{
+		Callbacks[ i ].refusals = 0;
+	}
+
+	xSemaphoreGive( Mutex );
 }
 
 void ClientCallbacks::Check( unsigned long t )
 {
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+
 	for ( uint8_t i = 0; i < NumCallbacks; i++ )
 	{
 		if ( ( Callbacks[ i ].activatedTime > ( t + ( 5 * 60 * 1000 ) ) ) || ( Callbacks[ i ].refusals > 10 ) )
 		{
-			Remove( i );
+			RemoveAt( i );
 			i--;
 		}
 	}
+
+	xSemaphoreGive( Mutex );
 }
 
 bool ClientCallbacks::HasCallbacks()
@@ -1404,95 +1858,688 @@ bool ClientCallbacks::HasCallbacks()
 
 CommandQ::CommandQ()
 {
-	NumQd  = 0;
-	QEntry = 0;
-	QExit  = 0;
+	NumQd	 = 0;
+	NextSeq	 = 0;
+	Rejected = 0;
+	Mutex	 = xSemaphoreCreateMutex();
 }
 
 CommandQ::~CommandQ()
 {
 }
 
-// Searche the queue to see if that request is already there
-bool CommandQ::Find( String Address, String Data )
+bool IsQueryCommand( const BLE_COMMAND* BLECommand )
 {
-  for (int i = 0; i < NumQd; i++)
-  {
-  	BLE_COMMAND* entry = &Callbacks[ i ];
-		if (strncmp( entry->Address, Address.c_str(), 18 ) != 0)
-    {
-      // No match so check next entry
-      continue;
-    }
-
-		if (memcmp( entry->Data, Data.c_str(), entry->DataLen ) != 0)
-    {
-      // No match so check next entry
-      continue;
-    }
-
-    return true;
-  }
+	return ( ( BLECommand->Data[ 0 ] == 87 ) && ( BLECommand->Data[ 1 ] == 15 ) && ( BLECommand->Data[ 2 ] == 72 ) && ( BLECommand->Data[ 3 ] == 1 ) ) ||
+		   ( ( BLECommand->Data[ 0 ] == 87 ) && ( BLECommand->Data[ 1 ] == 2 ) );
+}
 
-  return false;
+// Number of leading bytes that identify the type of command. The extended (0x0F) commands carry the
+// device type and sub-command in bytes 2 to 4, e.g. 57 0F 45 01 05 for a curtain position.
+static uint8_t ClassLength( const BLE_COMMAND* entry )
+{
+	uint8_t length = ( ( entry->DataLen > 1 ) && ( entry->Data[ 1 ] == 0x0F ) ) ? 5 : 2;
+	return ( entry->DataLen < length ) ? entry->DataLen : length;
 }
 
-bool CommandQ::Push( String Address, String Data, String ReplyTo )
+// Returns true if the commands are for the same device and do the same thing, so the newer one can replace the older
+static bool SameClass( const BLE_COMMAND* entry1, const BLE_COMMAND* entry2 )
 {
-	if ( NumQd < QSize )
+	if ( strncmp( entry1->Address, entry2->Address, 18 ) != 0 )
+	{
+		return false;
+	}
+
+	uint8_t length = ClassLength( entry1 );
+	if ( length != ClassLength( entry2 ) )
+	{
+		return false;
+	}
+
+	return ( memcmp( entry1->Data, entry2->Data, length ) == 0 );
+}
+
+// Fill in a command from the request parameters
+bool CommandQ::Build( const char* Address, const uint8_t* Data, int DataLen, const char* ReplyTo, uint8_t Priority, unsigned long Timeout, BLE_COMMAND* Command )
+{
+	memset( Command, 0, sizeof( BLE_COMMAND ) );
+
+	if ( ( Address == nullptr ) || ( DataLen <= 0 ) || ( DataLen > ( int ) sizeof( Command->Data ) ) )
+	{
+		return false;
+	}
+
+	strncpy( Command->Address, Address, 17 );
+	strupr( Command->Address );
+	strncpy( Command->ReplyTo, ReplyTo, 49 );
+	memcpy( Command->Data, Data, DataLen );
+	Command->DataLen  = DataLen;
+	Command->Priority = Priority;
+	Command->Enqueued = millis();
+	Command->Deadline = Command->Enqueued + Timeout;
+
+	if ( Priority == CMD_PRIORITY_DEFAULT )
+	{
+		Command->Priority = IsQueryCommand( Command ) ? CMD_PRIORITY_QUERY : CMD_PRIORITY_USER;
+	}
+
+	return true;
+}
+
+// Convert a list of decimal bytes ("[87,1,0]" or "87,1,0") into Buf. Returns the number of bytes or -1 if the text
+// isn't a list of bytes or doesn't fit.
+int CommandQ::ParseData( const char* Text, uint8_t* Buf, int BufSize )
+{
+	if ( Text == nullptr )
+	{
+		return -1;
+	}
+
+	const char* p = Text;
+	if ( *p == '[' )
 	{
-		NumQd++;
+		p++;
+	}
 
-		BLE_COMMAND* entry = &Callbacks[ QEntry++ ];
-		if ( QEntry == QSize )
+	int bytes = 0;
+	for ( ;; )
+	{
+		while ( *p == ' ' )
 		{
-			// Wrap entry index back to the beggining
-			QEntry = 0;
+			p++;
 		}
 
-		strncpy( entry->Address, Address.c_str(), 18 );
-		strncpy( entry->ReplyTo, ReplyTo.c_str(), 50 );
+		char* endPtr;
+		long value = strtol( p, &endPtr, 10 );
+		if ( ( endPtr == p ) || ( value < 0 ) || ( value > 255 ) || ( bytes >= BufSize ) )
+		{
+			return -1;
+		}
+
+		Buf[ bytes++ ] = ( uint8_t ) value;
+		p			   = endPtr;
+		while ( *p == ' ' )
+		{
+			p++;
+		}
+
+		if ( *p != ',' )
+		{
+			break;
+		}
+		p++;
+	}
 
-		uint8_t* buf = entry->Data;
-		char* endPtr = ( char* ) Data.c_str();
+	if ( ( *p == ']' ) || ( *p == 0 ) )
+	{
+		return bytes;
+	}
 
-		// Serial.printf( "Converting string %s to buffer: ", endPtr );
+	return -1;
+}
 
-		int bytes = 0;
-		do
+// Returns the index of a pending command that the new command would replace, or -1
+int CommandQ::FindSameClass( const BLE_COMMAND* Command )
+{
+	for ( int i = 0; i < NumQd; i++ )
+	{
+		if ( SameClass( &Callbacks[ i ], Command ) )
 		{
-			endPtr++;
-			buf[ bytes ] = strtol( endPtr, &endPtr, 10 );
-			// Serial.printf( "%i, ", buf[ bytes ] );
-			bytes++;
-		} while ( ( endPtr != nullptr ) && ( *endPtr != 0 ) && ( bytes < 10 ) );
+			return i;
+		}
+	}
 
-		// Serial.printf( "bytes = %i\n", bytes );
-		entry->DataLen = bytes;
+	return -1;
+}
 
-		return true;
+// Must be called with the mutex held
+CommandQResult CommandQ::Insert( const BLE_COMMAND* Command, uint32_t* Seq )
+{
+	int i = FindSameClass( Command );
+	if ( i >= 0 )
+	{
+		// Keep the place in the queue but send the latest data
+		BLE_COMMAND* entry = &Callbacks[ i ];
+		memcpy( entry->Data, Command->Data, sizeof( Command->Data ) );
+		entry->DataLen = Command->DataLen;
+		strncpy( entry->ReplyTo, Command->ReplyTo, 50 );
+		entry->Deadline = Command->Deadline;
+		entry->Enqueued = Command->Enqueued;
+		if ( Command->Priority < entry->Priority )
+		{
+			entry->Priority = Command->Priority;
+		}
+
+		if ( Seq )
+		{
+			*Seq = entry->Seq;
+		}
+
+		return CMDQ_REPLACED;
 	}
 
-	return false;
+	if ( NumQd >= QSize )
+	{
+		Rejected++;
+		return CMDQ_FULL;
+	}
+
+	Callbacks[ NumQd ]	   = *Command;
+	Callbacks[ NumQd ].Seq = NextSeq++;
+	if ( Seq )
+	{
+		*Seq = Callbacks[ NumQd ].Seq;
+	}
+	NumQd++;
+
+	return CMDQ_QUEUED;
 }
 
-bool CommandQ::Pop( BLE_COMMAND* pBLE_Command )
+CommandQResult CommandQ::Push( const BLE_COMMAND* Command, uint32_t* Seq )
 {
-	if ( NumQd > 0 )
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+	CommandQResult result = Insert( Command, Seq );
+	xSemaphoreGive( Mutex );
+
+	return result;
+}
+
+// Adds all the commands or none of them. Returns false if there isn't room for all of them.
+bool CommandQ::PushBatch( const BLE_COMMAND* Commands, int NumCommands, CommandQResult* Results )
+{
+	bool accepted = true;
+
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+
+	// Count the new entries needed, commands that replace a pending one or an earlier one in the batch don't need one
+	int needed = 0;
+	for ( int n = 0; n < NumCommands; n++ )
 	{
-		NumQd--;
+		bool replaces = ( FindSameClass( &Commands[ n ] ) >= 0 );
+		for ( int m = 0; ( m < n ) && !replaces; m++ )
+		{
+			replaces = SameClass( &Commands[ m ], &Commands[ n ] );
+		}
 
-		BLE_COMMAND* pEntry = &Callbacks[ QExit++ ];
-		memcpy( pBLE_Command, pEntry, sizeof( BLE_COMMAND ) );
+		if ( !replaces )
+		{
+			needed++;
+		}
+	}
 
-		if ( QExit == QSize )
+	if ( NumQd + needed > QSize )
+	{
+		accepted = false;
+		Rejected += NumCommands;
+		for ( int n = 0; n < NumCommands; n++ )
 		{
-			// Wrap entry index back to the beggining
-			QExit = 0;
+			Results[ n ] = CMDQ_FULL;
 		}
+	}
+	else
+	{
+		for ( int n = 0; n < NumCommands; n++ )
+		{
+			Results[ n ] = Insert( &Commands[ n ], nullptr );
+		}
+	}
 
-		return true;
+	xSemaphoreGive( Mutex );
+
+	return accepted;
+}
+
+void CommandQ::RemoveEntry( int Index )
+{
+	for ( int x = Index; x < NumQd - 1; x++ )
+	{
+		Callbacks[ x ] = Callbacks[ x + 1 ];
+	}
+
+	NumQd--;
+}
+
+// Returns true if there is an older command for the same device
+bool CommandQ::HasOlder( int Index )
+{
+	for ( int i = 0; i < NumQd; i++ )
+	{
+		if ( ( Callbacks[ i ].Seq < Callbacks[ Index ].Seq ) && ( strncmp( Callbacks[ i ].Address, Callbacks[ Index ].Address, 18 ) == 0 ) )
+		{
+			return true;
+		}
 	}
 
 	return false;
 }
+
+// Removes the most urgent command for a device that isn't busy. The commands for one device are
+// always sent in order of arrival, the priority decides which device goes next.
+bool CommandQ::Pop( BLE_COMMAND* pBLE_Command, DeviceBusyCheck IsBusy )
+{
+	unsigned long t = millis();
+	int best		= -1;
+
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+
+	for ( int i = 0; i < NumQd; i++ )
+	{
+		BLE_COMMAND* entry = &Callbacks[ i ];
+		if ( ( long ) ( t - entry->Deadline ) >= 0 )
+		{
+			// Expired, Expire() will remove it
+			continue;
+		}
+
+		if ( ( best >= 0 ) && ( ( entry->Priority > Callbacks[ best ].Priority ) ||
+								( ( entry->Priority == Callbacks[ best ].Priority ) && ( entry->Seq > Callbacks[ best ].Seq ) ) ) )
+		{
+			continue;
+		}
+
+		if ( HasOlder( i ) || ( ( IsBusy != nullptr ) && IsBusy( entry->Address ) ) )
+		{
+			continue;
+		}
+
+		best = i;
+	}
+
+	if ( best >= 0 )
+	{
+		memcpy( pBLE_Command, &Callbacks[ best ], sizeof( BLE_COMMAND ) );
+		RemoveEntry( best );
+	}
+
+	xSemaphoreGive( Mutex );
+
+	return ( best >= 0 );
+}
+
+int CommandQ::Expire( unsigned long t, BLE_COMMAND* Expired, int MaxExpired )
+{
+	int numExpired = 0;
+
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+
+	for ( int i = 0; ( i < NumQd ) && ( numExpired < MaxExpired ); i++ )
+	{
+		if ( ( long ) ( t - Callbacks[ i ].Deadline ) >= 0 )
+		{
+			Expired[ numExpired++ ] = Callbacks[ i ];
+			RemoveEntry( i );
+			i--;
+		}
+	}
+
+	xSemaphoreGive( Mutex );
+
+	return numExpired;
+}
+
+//=============================================================================================
+// GattCache Class
+
+GattCache::GattCache()
+{
+	memset( Entries, 0, sizeof( GATT_HANDLES ) * GATT_CACHE_SIZE );
+	NumEntries = 0;
+	Persist	   = false;
+}
+
+GattCache::~GattCache()
+{
+}
+
+void GattCache::Begin( bool persist )
+{
+	Persist = persist;
+	if ( !Persist )
+	{
+		return;
+	}
+
+	Preferences prefs;
+	if ( prefs.begin( "gattcache", true ) )
+	{
+		size_t bytes = prefs.getBytesLength( "handles" );
+		if ( ( bytes > 0 ) && ( bytes <= sizeof( Entries ) ) && ( ( bytes % sizeof( GATT_HANDLES ) ) == 0 ) )
+		{
+			prefs.getBytes( "handles", Entries, bytes );
+			NumEntries = bytes / sizeof( GATT_HANDLES );
+			LOG_INFO( "Loaded GATT handles for %i models", NumEntries );
+		}
+
+		prefs.end();
+	}
+}
+
+int GattCache::FindEntry( char model )
+{
+	for ( uint8_t i = 0; i < NumEntries; i++ )
+	{
+		if ( Entries[ i ].model == model )
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+bool GattCache::Get( char model, GATT_HANDLES& Handles )
+{
+	int i = FindEntry( model );
+	if ( ( i < 0 ) || ( Entries[ i ].writeHandle == 0 ) )
+	{
+		return false;
+	}
+
+	Handles = Entries[ i ];
+	return true;
+}
+
+void GattCache::Put( const GATT_HANDLES& Handles )
+{
+	if ( ( Handles.model == 0 ) || ( Handles.writeHandle == 0 ) )
+	{
+		return;
+	}
+
+	int i = FindEntry( Handles.model );
+	if ( i < 0 )
+	{
+		if ( NumEntries >= GATT_CACHE_SIZE )
+		{
+			return;
+		}
+
+		i = NumEntries++;
+		memset( &Entries[ i ], 0, sizeof( GATT_HANDLES ) );
+		Entries[ i ].model = Handles.model;
+	}
+
+	GATT_HANDLES& entry = Entries[ i ];
+	bool changed		= ( entry.writeHandle != Handles.writeHandle );
+	entry.writeHandle	= Handles.writeHandle;
+
+	// Write only commands don't discover the notification characteristic so keep what we already know
+	if ( ( Handles.notifyHandle != 0 ) && ( Handles.notifyCCCD != 0 ) )
+	{
+		changed			   = changed || ( entry.notifyHandle != Handles.notifyHandle ) || ( entry.notifyCCCD != Handles.notifyCCCD );
+		entry.notifyHandle = Handles.notifyHandle;
+		entry.notifyCCCD   = Handles.notifyCCCD;
+	}
+
+	if ( changed )
+	{
+		LOG_INFO( "Cached GATT handles for model %c: write %i, notify %i, CCCD %i", entry.model, entry.writeHandle, entry.notifyHandle, entry.notifyCCCD );
+		Save();
+	}
+}
+
+void GattCache::Invalidate( char model )
+{
+	int i = FindEntry( model );
+	if ( i < 0 )
+	{
+		return;
+	}
+
+	for ( uint8_t x = i; x < NumEntries - 1; x++ )
+	{
+		Entries[ x ] = Entries[ x + 1 ];
+	}
+
+	NumEntries--;
+	Save();
+}
+
+void GattCache::Save()
+{
+	if ( !Persist )
+	{
+		return;
+	}
+
+	Preferences prefs;
+	if ( prefs.begin( "gattcache", false ) )
+	{
+		if ( NumEntries > 0 )
+		{
+			prefs.putBytes( "handles", Entries, sizeof( GATT_HANDLES ) * NumEntries );
+		}
+		else
+		{
+			prefs.remove( "handles" );
+		}
+
+		prefs.end();
+	}
+}
+
+//=============================================================================================
+// CommandStats Class
+
+static const char* StageNames[ NUM_STAGES ] = { "queued", "connect", "discover", "write", "notify", "reply", "total" };
+
+CommandStats::CommandStats()
+{
+	memset( Models, 0, sizeof( Models ) );
+	memset( Devices, 0, sizeof( Devices ) );
+	NumModels = 0;
+	Lock	  = portMUX_INITIALIZER_UNLOCKED;
+}
+
+CommandStats::~CommandStats()
+{
+}
+
+static uint8_t StatsBucket( uint32_t ms )
+{
+	uint8_t bucket = 0;
+	while ( ( ( ms >> bucket ) > 0 ) && ( bucket < STATS_BUCKETS - 1 ) )
+	{
+		bucket++;
+	}
+
+	return bucket;
+}
+
+// Times are the millis() for each COMMAND_TIME, 0 if the command didn't get that far
+void CommandStats::Record( int DeviceIdx, char model, const unsigned long* Times, uint8_t Retries, bool Success )
+{
+	uint32_t stages[ NUM_STAGES ];
+	bool valid[ NUM_STAGES ];
+
+	for ( uint8_t i = 0; i < STAGE_TOTAL; i++ )
+	{
+		valid[ i ]	= ( Times[ i ] != 0 ) && ( Times[ i + 1 ] != 0 );
+		stages[ i ] = valid[ i ] ? Times[ i + 1 ] - Times[ i ] : 0;
+	}
+
+	valid[ STAGE_TOTAL ]  = ( Times[ TS_ENQUEUED ] != 0 ) && ( Times[ TS_DONE ] != 0 );
+	stages[ STAGE_TOTAL ] = valid[ STAGE_TOTAL ] ? Times[ TS_DONE ] - Times[ TS_ENQUEUED ] : 0;
+
+	portENTER_CRITICAL( &Lock );
+
+	// A command for a device that isn't in the table has no model to count it under
+	int m = ( model != 0 ) ? 0 : NumModels;
+	while ( ( m < NumModels ) && ( Models[ m ].model != model ) )
+	{
+		m++;
+	}
+
+	if ( ( model != 0 ) && ( m == NumModels ) && ( NumModels < STATS_MODELS ) )
+	{
+		Models[ NumModels++ ].model = model;
+	}
+
+	if ( m < NumModels )
+	{
+		MODEL_STATS& entry = Models[ m ];
+		entry.commands++;
+		entry.retries += Retries;
+		if ( !Success )
+		{
+			entry.failures++;
+		}
+
+		for ( uint8_t i = 0; i < NUM_STAGES; i++ )
+		{
+			uint16_t& count = entry.histogram[ i ][ StatsBucket( stages[ i ] ) ];
+			if ( valid[ i ] && ( count < 0xFFFF ) )
+			{
+				count++;
+			}
+		}
+	}
+
+	if ( ( DeviceIdx >= 0 ) && ( DeviceIdx < MAX_DEVICES ) )
+	{
+		DEVICE_STATS& entry = Devices[ DeviceIdx ];
+		entry.commands++;
+		entry.retries += Retries;
+		if ( !Success )
+		{
+			entry.failures++;
+		}
+
+		for ( uint8_t i = 0; i < NUM_STAGES; i++ )
+		{
+			if ( valid[ i ] )
+			{
+				entry.stageSum[ i ] += stages[ i ];
+				entry.stageCount[ i ]++;
+			}
+		}
+
+		if ( valid[ STAGE_TOTAL ] && ( stages[ STAGE_TOTAL ] > entry.maxTotal ) )
+		{
+			entry.maxTotal = stages[ STAGE_TOTAL ];
+		}
+	}
+
+	portEXIT_CRITICAL( &Lock );
+}
+
+// Writes the bucket counts and the p50 / p99 upper bounds (ms) of one histogram. Bucket n counts the
+// times from 2^(n-1) to 2^n - 1 ms.
+int CommandStats::HistogramToJson( const uint16_t* Histogram, char* Buf, int BufSize )
+{
+	uint32_t total = 0;
+	for ( uint8_t b = 0; b < STATS_BUCKETS; b++ )
+	{
+		total += Histogram[ b ];
+	}
+
+	uint32_t p50   = 0;
+	uint32_t p99   = 0;
+	uint32_t count = 0;
+	for ( uint8_t b = 0; b < STATS_BUCKETS; b++ )
+	{
+		count += Histogram[ b ];
+		if ( ( p50 == 0 ) && ( count * 100 >= total * 50 ) && ( count > 0 ) )
+		{
+			p50 = 1 << b;
+		}
+		if ( ( p99 == 0 ) && ( count * 100 >= total * 99 ) && ( count > 0 ) )
+		{
+			p99 = 1 << b;
+		}
+	}
+
+	// Leave out the empty buckets at the end to keep the JSON small
+	uint8_t numBuckets = STATS_BUCKETS;
+	while ( ( numBuckets > 1 ) && ( Histogram[ numBuckets - 1 ] == 0 ) )
+	{
+		numBuckets--;
+	}
+
+	int bytes = snprintf( Buf, BufSize, "{\"count\":%u,\"p50\":%u,\"p99\":%u,\"buckets\":[", total, p50, p99 );
+	for ( uint8_t b = 0; ( b < numBuckets ) && ( bytes < BufSize ); b++ )
+	{
+		bytes += snprintf( Buf + bytes, BufSize - bytes, "%u,", Histogram[ b ] );
+	}
+
+	bytes--;
+	if ( bytes < BufSize )
+	{
+		bytes += snprintf( Buf + bytes, BufSize - bytes, "]}" );
+	}
+
+	return bytes;
+}
+
+int CommandStats::ToJson( char* Buf, int BufSize, BLE_Device& BLEDevices, char* macAddress )
+{
+	int bytes = snprintf( Buf, BufSize, "{\"hubMAC\":\"%s\",\"models\":[", macAddress );
+
+	for ( uint8_t m = 0; ( m < NumModels ) && ( bytes < BufSize ); m++ )
+	{
+		// Copy the entry so the lock isn't held while formatting
+		MODEL_STATS entry;
+		portENTER_CRITICAL( &Lock );
+		entry = Models[ m ];
+		portEXIT_CRITICAL( &Lock );
+
+		bytes += snprintf( Buf + bytes, BufSize - bytes, "%s{\"model\":\"%c\",\"commands\":%u,\"failures\":%u,\"retries\":%u,\"stages\":{",
+						   ( m > 0 ) ? "," : "", entry.model, entry.commands, entry.failures, entry.retries );
+
+		for ( uint8_t i = 0; ( i < NUM_STAGES ) && ( bytes < BufSize ); i++ )
+		{
+			bytes += snprintf( Buf + bytes, BufSize - bytes, "%s\"%s\":", ( i > 0 ) ? "," : "", StageNames[ i ] );
+			if ( bytes < BufSize )
+			{
+				bytes += HistogramToJson( entry.histogram[ i ], Buf + bytes, BufSize - bytes );
+			}
+		}
+
+		if ( bytes < BufSize )
+		{
+			bytes += snprintf( Buf + bytes, BufSize - bytes, "}}" );
+		}
+	}
+
+	if ( bytes < BufSize )
+	{
+		bytes += snprintf( Buf + bytes, BufSize - bytes, "],\"devices\":[" );
+	}
+
+	bool first = true;
+	for ( uint8_t d = 0; ( d < BLEDevices.GetNumberOfDevices() ) && ( bytes < BufSize ); d++ )
+	{
+		DEVICE_STATS entry;
+		portENTER_CRITICAL( &Lock );
+		entry = Devices[ d ];
+		portEXIT_CRITICAL( &Lock );
+
+		SWITCHBOT Device;
+		if ( ( entry.commands == 0 ) || !BLEDevices.GetSWDevice( d, Device ) )
+		{
+			continue;
+		}
+
+		bytes += snprintf( Buf + bytes, BufSize - bytes, "%s{\"address\":\"%s\",\"model\":\"%c\",\"commands\":%u,\"failures\":%u,\"retries\":%u,\"maxTotal\":%u,\"average\":{",
+						   first ? "" : ",", Device.MAC, Device.model, entry.commands, entry.failures, entry.retries, entry.maxTotal );
+		first = false;
+
+		for ( uint8_t i = 0; ( i < NUM_STAGES ) && ( bytes < BufSize ); i++ )
+		{
+			bytes += snprintf( Buf + bytes, BufSize - bytes, "%s\"%s\":%u", ( i > 0 ) ? "," : "", StageNames[ i ],
+							   entry.stageCount[ i ] ? entry.stageSum[ i ] / entry.stageCount[ i ] : 0 );
+		}
+
+		if ( bytes < BufSize )
+		{
+			bytes += snprintf( Buf + bytes, BufSize - bytes, "}}" );
+		}
+	}
+
+	if ( bytes < BufSize )
+	{
+		bytes += snprintf( Buf + bytes, BufSize - bytes, "]}" );
+	}
+
+	return ( bytes < BufSize ) ? bytes : -1;
+}
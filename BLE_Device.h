@@ -22,20 +22,46 @@
 #include <Arduino.h>
 #include <stdint.h>
 
+// Command priorities, lower values are sent first
+#define CMD_PRIORITY_USER		0	 // Direct user action
+#define CMD_PRIORITY_AUTOMATION 1	 // Flows / scenes
+#define CMD_PRIORITY_QUERY		2	 // Status requests
+#define CMD_PRIORITY_DEFAULT	0xFF // Set from the command data
+
 typedef struct BLE_COMMAND
 {
 	char Address[ 18 ];
 	char ReplyTo[ 50 ];
 	uint8_t Data[ 20 ];
 	int8_t DataLen;
+	uint8_t Priority;
+	unsigned long Deadline;	   // millis() after which the command is dropped
+	uint32_t Seq;			   // Order of arrival
+	unsigned long Enqueued;	   // millis() when it was added to the queue
 };
 typedef struct BLE_DEVICE
 {
 	char MAC[ 18 ];
+	uint8_t AddrType;	 // BLE_ADDR_PUBLIC or BLE_ADDR_RANDOM, needed to connect without the scan results
 	int rssi;
 	uint8_t Data[ 21 ];
 	uint8_t DataSize;
 	bool Changed;
+	unsigned long ChangedTime;	  // millis() of the oldest change not yet sent
+	uint32_t Seq;				  // Change sequence number when the device last changed
+	unsigned long LastSeen;		  // millis() of the last advert, before boot (wrapped) for a restored device
+	bool Stale;					  // Restored at boot and not heard from since
+};
+
+// What is kept in NVS for each device
+typedef struct SAVED_DEVICE
+{
+	char MAC[ 18 ];
+	uint8_t AddrType;
+	int8_t rssi;
+	uint8_t DataSize;
+	uint8_t Data[ 21 ];
+	uint32_t Age;	 // Seconds since the last advert when it was saved
 };
 
 struct SWICHBOT_BOT
@@ -139,12 +165,65 @@ typedef struct SWITCHBOT
 	};
 };
 
+#define MAX_DEVICES 50
+
+// State transitions of the event models
+enum DeviceEventKind
+{
+	EVENT_MOTION,
+	EVENT_CONTACT,
+	EVENT_LIGHT,
+	EVENT_BUTTON,	 // One for each press, the value is the press counter
+	EVENT_ENTRY,
+	EVENT_EXIT,
+	EVENT_LEAK,
+	EVENT_REMOTE,	 // Value is the three data bytes
+	NUM_EVENT_KINDS
+};
+
+typedef struct DEVICE_EVENT
+{
+	uint8_t kind;
+	uint32_t value;
+};
+
+#define MAX_DEVICE_EVENTS 24	// Most transitions between two adverts, 15 button presses plus entries, exits and states
+
+// Fills Events with the transitions from Old to New, returns how many
+int FindDeviceEvents( const SWITCHBOT& Old, const SWITCHBOT& New, DEVICE_EVENT* Events );
+const char* GetEventName( uint8_t Kind );
+
+// Returns true for models that report events (contact, motion, button, leak) rather than periodic readings
+bool IsEventModel( char model );
+
+// Returns true for models whose state is read from the manufacturer data, which only an active scan is sure to get
+bool NeedsScanResponse( char model );
+
+// Returns true if the device's changes should go to the callbacks
+typedef bool ( *DeviceReportCheck )( uint8_t Index );
+
+// What AddDevice did with an advert
+enum AdvertResult
+{
+	ADVERT_INVALID,		 // Not a known model or the data is the wrong size
+	ADVERT_NO_ROOM,		 // New device but the table is full
+	ADVERT_ADDED,
+	ADVERT_CHANGED,
+	ADVERT_UNCHANGED
+};
+
 class BLE_Device
 {
   private:
-	BLE_DEVICE BLE_devices[ 50 ];
+	BLE_DEVICE BLE_devices[ MAX_DEVICES ];
 	uint8_t NumDevices;
 	bool Changed;
+	volatile uint32_t ChangeSeq;	// Incremented every time a device is added or changes
+	SemaphoreHandle_t JsonMutex;	// Recursive, held by the ingest task while it writes the table and by the other tasks while they read it
+	bool Persist;
+	unsigned long SaveDue;			// When the table should next be saved, 0 if it hasn't changed
+	uint32_t Saves;
+	void ScheduleSave( unsigned long Delay );
 	bool parseDevice( BLE_DEVICE& Device, SWITCHBOT& SW_Device );
 	bool parseBot( BLE_DEVICE& Device, SWITCHBOT& SW_Device );
 	bool parseCurtain( BLE_DEVICE& Device, SWITCHBOT& SW_Device );
@@ -163,8 +242,15 @@ class BLE_Device
 	BLE_Device();
 	~BLE_Device();
 
+	void Begin( bool persist );						   // Restore the devices saved in NVS, marked as stale
+	bool SaveIfDue( unsigned long t, bool Force );
+	uint32_t GetNumberOfSaves()
+	{
+		return Saves;
+	};
+
 	int FindDevice( const char* MAC );
-	bool AddDevice( const char* MAC, int rssi, uint8_t* BLEData,
+	AdvertResult AddDevice( const char* MAC, uint8_t AddrType, int rssi, uint8_t* BLEData,
 					uint8_t BLEDataSize, uint8_t* ManufactureData,
 					uint8_t ManufactureDataSize );
 	void UpdateDevice( uint8_t Index, int rssi, uint8_t* BLEData,
@@ -174,14 +260,24 @@ class BLE_Device
 						uint8_t BLEDataSize, uint8_t* ManufactureData,
 						uint8_t ManufactureDataSize );
 	bool GetSWDevice( uint8_t Index, SWITCHBOT& Device );
+	uint8_t GetAddressType( uint8_t Index );
+	bool IsStale( uint8_t Index );	  // Restored at boot and not heard from since
 	int DeviceToJson( uint8_t Index, char* Buf, int BufSize, char* macAddress );
-	int AllToJson( char* Buf, int BufSize, bool OnlyChanged, char* macAddress );
+	int AllToJson( char* Buf, int BufSize, bool OnlyChanged, char* macAddress, DeviceReportCheck ShouldReport = nullptr );	  // With OnlyChanged the devices ShouldReport refuses are dropped
+	int TakeChangedEvents( uint8_t* Indexes, int Max, unsigned long* Oldest );	  // Changed event devices, no longer marked as changed
+	void MarkChanged( uint8_t Index );	  // Send a device again, one that couldn't be sent or that this hub just took over
+	int FilteredToJson( char* Buf, int BufSize, uint32_t Since, char Model, const char* MAC, char* macAddress );	   // Model 0 and MAC nullptr match all, -1 if they don't all fit
 	void ClearChanged();
 	bool HasChanged();
+	bool HasEventChange();	  // A device with an event model has changed
 	int GetNumberOfDevices()
 	{
 		return NumDevices;
 	};
+	uint32_t GetChangeSeq()
+	{
+		return ChangeSeq;
+	};
 };
 
 typedef struct CALL_BACK
@@ -196,6 +292,9 @@ class ClientCallbacks
   private:
 	CALL_BACK Callbacks[ 5 ];
 	int NumCallbacks;
+	SemaphoreHandle_t Mutex;	// Used by the web server, callback, event and command tasks
+	int FindIndex( const char* url );
+	void RemoveAt( uint8_t Index );
 
   public:
 	ClientCallbacks();
@@ -203,31 +302,157 @@ class ClientCallbacks
 
 	bool Add( const char* url, unsigned long t );
 	bool Find( const char* url, char* full_url, int bufSize );
-	bool Remove( uint8_t Index );
 	bool Remove( const char* url );
 	bool Get( uint8_t Index, char* buf, int BufLength );
 	void Check( unsigned long t );	  // Call this periodically to remove expired callbacks
-	void addRefusal( uint8_t Index );
-	void resetRefusal( uint8_t Index );
+	void addRefusal( const char* url );		// By URL as another task may have removed an earlier entry since Get
+	void resetRefusal( const char* url );
   bool HasCallbacks();
 };
 
+// Returns true if the command needs data returned via the notification characteristic
+bool IsQueryCommand( const BLE_COMMAND* BLECommand );
+
+// Returns true if the device at that address can't accept another command yet
+typedef bool ( *DeviceBusyCheck )( const char* Address );
+
+enum CommandQResult
+{
+	CMDQ_QUEUED,	  // Added to the queue
+	CMDQ_REPLACED,	  // Replaced a pending command of the same class for that device
+	CMDQ_FULL
+};
+
+#define MAX_BATCH 20	 // Most commands in one batch request, no more than the queue can hold
+
 class CommandQ
 {
   private:
 #define QSize 20
 	BLE_COMMAND Callbacks[ QSize ];
 	int NumQd;
-	int QEntry;
-	int QExit;
+	uint32_t NextSeq;
+	SemaphoreHandle_t Mutex;	// A mutex, not a spinlock, as Pop asks the caller which devices are busy
+	void RemoveEntry( int Index );
+	bool HasOlder( int Index );
+	int FindSameClass( const BLE_COMMAND* Command );
+	CommandQResult Insert( const BLE_COMMAND* Command, uint32_t* Seq );
+	uint32_t Rejected;	  // Commands refused because the queue was full
 
   public:
 	CommandQ();
 	~CommandQ();
 
-  bool Find( String Address, String Data );
-	bool Push( String Address, String Data, String ReplyTo );
-	bool Pop( BLE_COMMAND* pBLE_Command );
+	static bool Build( const char* Address, const uint8_t* Data, int DataLen, const char* ReplyTo, uint8_t Priority, unsigned long Timeout, BLE_COMMAND* Command );
+	static int ParseData( const char* Text, uint8_t* Buf, int BufSize );
+	CommandQResult Push( const BLE_COMMAND* Command, uint32_t* Seq = nullptr );	   // Seq of the queued (or replaced) entry
+	bool PushBatch( const BLE_COMMAND* Commands, int NumCommands, CommandQResult* Results );
+	bool Pop( BLE_COMMAND* pBLE_Command, DeviceBusyCheck IsBusy = nullptr );
+	int Expire( unsigned long t, BLE_COMMAND* Expired, int MaxExpired );	// Removes commands that are past their deadline
+	int GetNumberQueued()
+	{
+		return NumQd;
+	};
+	uint32_t GetNumberRejected()
+	{
+		return Rejected;
+	};
+};
+
+// GATT attribute handles for one model. SwitchBot devices have a fixed attribute table per model
+// so once discovered the handles can be used directly on the next connection.
+typedef struct GATT_HANDLES
+{
+	char model;
+	uint16_t writeHandle;
+	uint16_t notifyHandle;
+	uint16_t notifyCCCD;
+};
+
+class GattCache
+{
+  private:
+#define GATT_CACHE_SIZE 16
+	GATT_HANDLES Entries[ GATT_CACHE_SIZE ];
+	uint8_t NumEntries;
+	bool Persist;
+	int FindEntry( char model );
+	void Save();
+
+  public:
+	GattCache();
+	~GattCache();
+
+	void Begin( bool persist );	   // Load any handles saved in NVS
+	bool Get( char model, GATT_HANDLES& Handles );
+	void Put( const GATT_HANDLES& Handles );
+	void Invalidate( char model );
+};
+
+// Time stamps taken as a command moves through the executor
+enum COMMAND_TIME
+{
+	TS_ENQUEUED,
+	TS_DEQUEUED,
+	TS_CONNECTED,
+	TS_DISCOVERED,
+	TS_WRITTEN,
+	TS_NOTIFIED,
+	TS_REPLIED,
+	TS_DONE,
+	NUM_TIMES
+};
+
+// Each stage is the time between two consecutive time stamps, plus the total
+enum COMMAND_STAGE
+{
+	STAGE_QUEUED,
+	STAGE_CONNECT,
+	STAGE_DISCOVER,
+	STAGE_WRITE,
+	STAGE_NOTIFY,
+	STAGE_REPLY,
+	STAGE_TOTAL,
+	NUM_STAGES
+};
+
+#define STATS_BUCKETS 16	// Power of 2 millisecond buckets, the last one is everything over 16 seconds
+#define STATS_MODELS  16
+
+typedef struct MODEL_STATS
+{
+	char model;
+	uint32_t commands;
+	uint32_t failures;
+	uint32_t retries;
+	uint16_t histogram[ NUM_STAGES ][ STATS_BUCKETS ];
+};
+
+typedef struct DEVICE_STATS
+{
+	uint32_t commands;
+	uint32_t failures;
+	uint32_t retries;
+	uint32_t stageSum[ NUM_STAGES ];
+	uint32_t stageCount[ NUM_STAGES ];
+	uint32_t maxTotal;
+};
+
+class CommandStats
+{
+  private:
+	MODEL_STATS Models[ STATS_MODELS ];
+	uint8_t NumModels;
+	DEVICE_STATS Devices[ MAX_DEVICES ];
+	portMUX_TYPE Lock;
+	int HistogramToJson( const uint16_t* Histogram, char* Buf, int BufSize );
+
+  public:
+	CommandStats();
+	~CommandStats();
+
+	void Record( int DeviceIdx, char model, const unsigned long* Times, uint8_t Retries, bool Success );
+	int ToJson( char* Buf, int BufSize, BLE_Device& Devices, char* macAddress );
 };
 
 #endif
@@ -0,0 +1,156 @@
+/*
+	<SwitchBotBLEHub:- Turn a ESP32 Arduio compatible board into a hub>
+	Copyright (C) <2020>  <Adrian Rockall>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "HubBuffers.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Buffer sizes and how many of each, smallest first. Sized for the replies the hub builds:
+// callback addresses, notify replies, single device and batch replies, the device table and command statistics.
+static const uint16_t BufferClassSizes[ BUFFER_CLASSES ]  = { 256, 512, 2048, 4096, 6144 };
+static const uint8_t BufferClassCounts[ BUFFER_CLASSES ] = { 4, 6, 3, 2, 1 };
+
+BufferPool::BufferPool()
+{
+	memset( Classes, 0, sizeof( Classes ) );
+	Arena	  = nullptr;
+	ArenaSize = 0;
+}
+
+BufferPool::~BufferPool()
+{
+}
+
+bool BufferPool::Begin()
+{
+	if ( Arena != nullptr )
+	{
+		return true;
+	}
+
+	size_t size = 0;
+	for ( int i = 0; i < BUFFER_CLASSES; i++ )
+	{
+		size += BufferClassSizes[ i ] * BufferClassCounts[ i ];
+	}
+
+	Arena = ( char* ) malloc( size );
+	if ( Arena == nullptr )
+	{
+		return false;
+	}
+
+	ArenaSize = size;
+
+	char* next = Arena;
+	for ( int i = 0; i < BUFFER_CLASSES; i++ )
+	{
+		Classes[ i ].size	  = BufferClassSizes[ i ];
+		Classes[ i ].count	  = BufferClassCounts[ i ];
+		Classes[ i ].first	  = next;
+		Classes[ i ].freeMask = ( 1UL << BufferClassCounts[ i ] ) - 1;
+		next += BufferClassSizes[ i ] * BufferClassCounts[ i ];
+	}
+
+	return true;
+}
+
+// Takes the smallest free buffer that fits. If every buffer of the right size is in use a larger one is used.
+char* BufferPool::Borrow( size_t Size )
+{
+	int wanted = -1;
+
+	for ( int i = 0; i < BUFFER_CLASSES; i++ )
+	{
+		BUFFER_CLASS* bufferClass = &Classes[ i ];
+		if ( bufferClass->size < Size )
+		{
+			continue;
+		}
+
+		if ( wanted < 0 )
+		{
+			wanted = i;
+		}
+
+		uint32_t mask = __atomic_load_n( &bufferClass->freeMask, __ATOMIC_ACQUIRE );
+		while ( mask != 0 )
+		{
+			int bit = __builtin_ctz( mask );
+			if ( __atomic_compare_exchange_n( &bufferClass->freeMask, &mask, mask & ~( 1UL << bit ), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+			{
+				if ( i != wanted )
+				{
+					__atomic_fetch_add( &Classes[ wanted ].exhausted, 1, __ATOMIC_RELAXED );
+				}
+
+				return bufferClass->first + ( bit * bufferClass->size );
+			}
+		}
+	}
+
+	if ( wanted >= 0 )
+	{
+		__atomic_fetch_add( &Classes[ wanted ].exhausted, 1, __ATOMIC_RELAXED );
+		__atomic_fetch_add( &Classes[ wanted ].failed, 1, __ATOMIC_RELAXED );
+	}
+
+	return nullptr;
+}
+
+void BufferPool::Return( void* Buf )
+{
+	char* buf = ( char* ) Buf;
+	if ( ( buf == nullptr ) || ( buf < Arena ) || ( buf >= ( Arena + ArenaSize ) ) )
+	{
+		return;
+	}
+
+	for ( int i = BUFFER_CLASSES - 1; i >= 0; i-- )
+	{
+		if ( buf >= Classes[ i ].first )
+		{
+			int bit = ( buf - Classes[ i ].first ) / Classes[ i ].size;
+			__atomic_fetch_or( &Classes[ i ].freeMask, 1UL << bit, __ATOMIC_RELEASE );
+			return;
+		}
+	}
+}
+
+void BufferPool::Write( Print& Out )
+{
+	Out.print( "# HELP switchbot_buffers_in_use Pool buffers borrowed, by size\n# TYPE switchbot_buffers_in_use gauge\n" );
+	for ( int i = 0; i < BUFFER_CLASSES; i++ )
+	{
+		Out.printf( "switchbot_buffers_in_use{size=\"%u\"} %u\n", Classes[ i ].size, Classes[ i ].count - __builtin_popcount( Classes[ i ].freeMask ) );
+	}
+
+	Out.print( "# HELP switchbot_buffers_exhausted_total Borrows that found no free buffer of their size\n# TYPE switchbot_buffers_exhausted_total counter\n" );
+	for ( int i = 0; i < BUFFER_CLASSES; i++ )
+	{
+		Out.printf( "switchbot_buffers_exhausted_total{size=\"%u\"} %u\n", Classes[ i ].size, Classes[ i ].exhausted );
+	}
+
+	Out.print( "# HELP switchbot_buffers_failed_total Borrows that found no free buffer at all\n# TYPE switchbot_buffers_failed_total counter\n" );
+	for ( int i = 0; i < BUFFER_CLASSES; i++ )
+	{
+		Out.printf( "switchbot_buffers_failed_total{size=\"%u\"} %u\n", Classes[ i ].size, Classes[ i ].failed );
+	}
+}
@@ -0,0 +1,56 @@
+/*
+	<SwitchBotBLEHub:- Turn a ESP32 Arduio compatible board into a hub>
+	Copyright (C) <2020>  <Adrian Rockall>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARDUINO_HUB_BUFFERS_H
+#define ARDUINO_HUB_BUFFERS_H
+
+#include <Arduino.h>
+#include <stdint.h>
+
+#define BUFFER_CLASSES 5	// See BufferClassSizes in HubBuffers.cpp
+
+typedef struct BUFFER_CLASS
+{
+	uint16_t size;
+	uint8_t count;
+	char* first;				 // Start of the buffers of this size in the arena
+	uint32_t freeMask;			 // Bit set for each free buffer
+	uint32_t exhausted;			 // Borrows of this size that had to use a larger buffer or failed
+	uint32_t failed;			 // Borrows of this size that failed
+};
+
+// JSON and reply buffers are borrowed from a fixed arena reserved at boot instead of the heap, so building a reply
+// can't fragment the heap. Borrow and Return can be called from any task.
+class BufferPool
+{
+  private:
+	BUFFER_CLASS Classes[ BUFFER_CLASSES ];
+	char* Arena;
+	size_t ArenaSize;
+
+  public:
+	BufferPool();
+	~BufferPool();
+
+	bool Begin();						 // Reserve the arena, call once at boot while the heap is unfragmented
+	char* Borrow( size_t Size );		 // nullptr if every buffer big enough is in use
+	void Return( void* Buf );			 // nullptr is ignored
+	void Write( Print& Out );			 // Prometheus text format
+};
+
+#endif
@@ -0,0 +1,211 @@
+/*
+	<SwitchBotBLEHub:- Turn a ESP32 Arduio compatible board into a hub>
+	Copyright (C) <2020>  <Adrian Rockall>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "HubJournal.h"
+#include <stdio.h>
+#include <string.h>
+
+EventJournal::EventJournal()
+{
+	memset( Journals, 0, sizeof( Journals ) );
+	for ( int i = 0; i < JOURNAL_DEVICES; i++ )
+	{
+		Journals[ i ].device = -1;
+	}
+
+	NextSeq		= 1;
+	Recorded	= 0;
+	Overwritten = 0;
+	NoJournal	= 0;
+	Mutex		= xSemaphoreCreateMutex();
+}
+
+EventJournal::~EventJournal()
+{
+}
+
+// Call with the mutex held
+DEVICE_JOURNAL* EventJournal::FindJournal( int Device, bool Claim )
+{
+	DEVICE_JOURNAL* free = nullptr;
+
+	for ( int i = 0; i < JOURNAL_DEVICES; i++ )
+	{
+		if ( Journals[ i ].device == Device )
+		{
+			return &Journals[ i ];
+		}
+
+		if ( ( free == nullptr ) && ( Journals[ i ].device < 0 ) )
+		{
+			free = &Journals[ i ];
+		}
+	}
+
+	if ( Claim && ( free != nullptr ) )
+	{
+		free->device = Device;
+		return free;
+	}
+
+	return nullptr;
+}
+
+void EventJournal::Record( int Device, const char* MAC, char Model, const DEVICE_EVENT* Events, int NumEvents, unsigned long t )
+{
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+
+	DEVICE_JOURNAL* journal = FindJournal( Device, true );
+	if ( journal == nullptr )
+	{
+		NoJournal += NumEvents;
+		xSemaphoreGive( Mutex );
+		return;
+	}
+
+	strlcpy( journal->MAC, MAC, sizeof( journal->MAC ) );
+	journal->model = Model;
+
+	for ( int i = 0; i < NumEvents; i++ )
+	{
+		JOURNAL_ENTRY* entry = &journal->entries[ journal->written % JOURNAL_SIZE ];
+		if ( ( journal->written >= JOURNAL_SIZE ) && ( entry->seq > journal->delivered ) )
+		{
+			Overwritten++;
+		}
+
+		entry->seq	 = NextSeq++;
+		entry->time	 = t;
+		entry->kind	 = Events[ i ].kind;
+		entry->value = Events[ i ].value;
+		journal->written++;
+		Recorded++;
+	}
+
+	xSemaphoreGive( Mutex );
+}
+
+int EventJournal::UndeliveredToJson( int Device, char* Buf, int BufSize, uint32_t* Last )
+{
+	int bytes = snprintf( Buf, BufSize, "[" );
+	*Last	  = 0;
+
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+
+	DEVICE_JOURNAL* journal = FindJournal( Device, false );
+	if ( journal != nullptr )
+	{
+		uint32_t first = ( journal->written > JOURNAL_SIZE ) ? journal->written - JOURNAL_SIZE : 0;
+		for ( uint32_t i = first; i < journal->written; i++ )
+		{
+			JOURNAL_ENTRY* entry = &journal->entries[ i % JOURNAL_SIZE ];
+			if ( entry->seq <= journal->delivered )
+			{
+				continue;
+			}
+
+			int entryBytes = snprintf( Buf + bytes, BufSize - bytes, "%s{\"seq\":%u,\"event\":\"%s\",\"value\":%u,\"age\":%lu}",
+									   ( bytes > 1 ) ? "," : "", entry->seq, GetEventName( entry->kind ), entry->value, millis() - entry->time );
+			if ( entryBytes >= ( BufSize - bytes - 1 ) )
+			{
+				break;	  // The rest go next time
+			}
+
+			bytes += entryBytes;
+			*Last = entry->seq;
+		}
+	}
+
+	xSemaphoreGive( Mutex );
+
+	bytes += snprintf( Buf + bytes, BufSize - bytes, "]" );
+	return bytes;
+}
+
+void EventJournal::MarkDelivered( int Device, uint32_t Last )
+{
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+
+	DEVICE_JOURNAL* journal = FindJournal( Device, false );
+	if ( ( journal != nullptr ) && ( Last > journal->delivered ) )
+	{
+		journal->delivered = Last;
+	}
+
+	xSemaphoreGive( Mutex );
+}
+
+// The sequence numbers start again at each boot, BootId tells the client when that has happened
+int EventJournal::ToJson( char* Buf, int BufSize, uint32_t Since, char* macAddress, uint32_t BootId, uint32_t* Next )
+{
+	int bytes	  = snprintf( Buf, BufSize, "{\"hubMAC\":\"%s\",\"bootId\":\"%08x\",\"events\":[", macAddress, BootId );
+	uint32_t last = Since;
+
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+
+	// Repeatedly take the lowest sequence number after the last one written, there are only a few hundred entries
+	for ( ;; )
+	{
+		DEVICE_JOURNAL* journal = nullptr;
+		JOURNAL_ENTRY* next		= nullptr;
+
+		for ( int i = 0; i < JOURNAL_DEVICES; i++ )
+		{
+			uint32_t first = ( Journals[ i ].written > JOURNAL_SIZE ) ? Journals[ i ].written - JOURNAL_SIZE : 0;
+			for ( uint32_t e = first; e < Journals[ i ].written; e++ )
+			{
+				JOURNAL_ENTRY* entry = &Journals[ i ].entries[ e % JOURNAL_SIZE ];
+				if ( ( entry->seq > last ) && ( ( next == nullptr ) || ( entry->seq < next->seq ) ) )
+				{
+					journal = &Journals[ i ];
+					next	= entry;
+				}
+			}
+		}
+
+		if ( next == nullptr )
+		{
+			break;
+		}
+
+		// Leave room for the closing brackets
+		int entryBytes = snprintf( Buf + bytes, BufSize - bytes, "%s{\"seq\":%u,\"address\":\"%s\",\"model\":\"%c\",\"event\":\"%s\",\"value\":%u,\"age\":%lu}",
+								   ( last != Since ) ? "," : "", next->seq, journal->MAC, journal->model, GetEventName( next->kind ), next->value, millis() - next->time );
+		if ( entryBytes >= ( BufSize - bytes - 3 ) )
+		{
+			break;
+		}
+
+		bytes += entryBytes;
+		last = next->seq;
+	}
+
+	xSemaphoreGive( Mutex );
+
+	bytes += snprintf( Buf + bytes, BufSize - bytes, "]}" );
+	*Next = last;
+	return bytes;
+}
+
+void EventJournal::Write( Print& Out )
+{
+	Out.printf( "# HELP switchbot_events_total Event device state transitions recorded\n# TYPE switchbot_events_total counter\nswitchbot_events_total %u\n", Recorded );
+	Out.printf( "# HELP switchbot_events_overwritten_total Events overwritten before they reached the callbacks\n# TYPE switchbot_events_overwritten_total counter\nswitchbot_events_overwritten_total %u\n", Overwritten );
+	Out.printf( "# HELP switchbot_events_no_journal_total Events dropped because every journal was in use\n# TYPE switchbot_events_no_journal_total counter\nswitchbot_events_no_journal_total %u\n", NoJournal );
+}
@@ -0,0 +1,75 @@
+/*
+	<SwitchBotBLEHub:- Turn a ESP32 Arduio compatible board into a hub>
+	Copyright (C) <2020>  <Adrian Rockall>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARDUINO_HUB_JOURNAL_H
+#define ARDUINO_HUB_JOURNAL_H
+
+#include "BLE_Device.h"
+#include <Arduino.h>
+#include <stdint.h>
+
+#define JOURNAL_DEVICES 16	  // Event devices that can have a journal
+#define JOURNAL_SIZE	16	  // Events kept for each device
+
+typedef struct JOURNAL_ENTRY
+{
+	uint32_t seq;
+	unsigned long time;
+	uint8_t kind;	 // DeviceEventKind
+	uint32_t value;
+};
+
+typedef struct DEVICE_JOURNAL
+{
+	int device;			  // Index in the device table, -1 for a free journal
+	char MAC[ 18 ];
+	char model;
+	uint32_t written;	  // Entries ever written, the next one goes in entries[ written % JOURNAL_SIZE ]
+	uint32_t delivered;	  // Sequence number of the last entry sent to the callbacks
+	JOURNAL_ENTRY entries[ JOURNAL_SIZE ];
+};
+
+// Every state transition of the event devices, numbered in the order they happened. Each device keeps its last
+// JOURNAL_SIZE transitions so edges between two callbacks aren't lost to the next state.
+class EventJournal
+{
+  private:
+	DEVICE_JOURNAL Journals[ JOURNAL_DEVICES ];
+	uint32_t NextSeq;
+	uint32_t Recorded;
+	uint32_t Overwritten;	 // Entries lost before they were delivered
+	uint32_t NoJournal;		 // Events from devices that didn't get a journal
+	SemaphoreHandle_t Mutex;
+	DEVICE_JOURNAL* FindJournal( int Device, bool Claim );
+
+  public:
+	EventJournal();
+	~EventJournal();
+
+	void Record( int Device, const char* MAC, char Model, const DEVICE_EVENT* Events, int NumEvents, unsigned long t );
+	int UndeliveredToJson( int Device, char* Buf, int BufSize, uint32_t* Last );	// Array of the entries not yet sent to the callbacks, Last is the newest one included
+	void MarkDelivered( int Device, uint32_t Last );								// Once a callback has accepted the entries up to Last
+	int ToJson( char* Buf, int BufSize, uint32_t Since, char* macAddress, uint32_t BootId, uint32_t* Next );	// Entries after Since in order
+	uint32_t GetSeq()
+	{
+		return NextSeq;
+	};
+	void Write( Print& Out );	 // Prometheus text format
+};
+
+#endif
@@ -0,0 +1,161 @@
+/*
+	<SwitchBotBLEHub:- Turn a ESP32 Arduio compatible board into a hub>
+	Copyright (C) <2020>  <Adrian Rockall>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "HubLog.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+HubLogger HubLog;
+
+static const char LevelNames[] = { '-', 'E', 'W', 'I', 'D' };
+
+HubLogger::HubLogger()
+{
+	memset( ( void* ) Entries, 0, sizeof( Entries ) );
+	Head	  = 0;
+	Printed	  = 0;
+	Dropped	  = 0;
+	DrainTask = nullptr;
+}
+
+HubLogger::~HubLogger()
+{
+}
+
+void HubLogger::Begin( UBaseType_t Priority )
+{
+	if ( DrainTask == nullptr )
+	{
+		xTaskCreate( Drain, "LogDrain", 3072, this, Priority, &DrainTask );
+	}
+}
+
+// Can be called from any task. Claims the next entry and formats the line straight into it.
+void HubLogger::Write( uint8_t Level, const char* Format, ... )
+{
+	uint32_t seq	 = __atomic_fetch_add( &Head, 1, __ATOMIC_RELAXED );
+	LOG_ENTRY* entry = &Entries[ seq & ( LOG_ENTRIES - 1 ) ];
+
+	__atomic_store_n( &entry->seq, 0, __ATOMIC_RELAXED );
+	__atomic_thread_fence( __ATOMIC_RELEASE );
+
+	entry->time	 = millis();
+	entry->level = Level;
+
+	va_list args;
+	va_start( args, Format );
+	vsnprintf( entry->text, LOG_LINE_SIZE, Format, args );
+	va_end( args );
+
+	__atomic_store_n( &entry->seq, seq + 1, __ATOMIC_RELEASE );
+}
+
+// Copy an entry, returns false if it isn't complete or was overwritten while being copied
+bool HubLogger::ReadEntry( uint32_t Seq, LOG_ENTRY& Entry )
+{
+	LOG_ENTRY* entry = &Entries[ Seq & ( LOG_ENTRIES - 1 ) ];
+
+	if ( __atomic_load_n( &entry->seq, __ATOMIC_ACQUIRE ) != ( Seq + 1 ) )
+	{
+		return false;
+	}
+
+	memcpy( ( void* ) &Entry, ( const void* ) entry, sizeof( LOG_ENTRY ) );
+	__atomic_thread_fence( __ATOMIC_ACQUIRE );
+
+	Entry.text[ LOG_LINE_SIZE - 1 ] = 0;
+	return __atomic_load_n( &entry->seq, __ATOMIC_RELAXED ) == ( Seq + 1 );
+}
+
+void HubLogger::Drain( void* Parameter )
+{
+	HubLogger* log = ( HubLogger* ) Parameter;
+	LOG_ENTRY entry;
+
+	for ( ;; )
+	{
+		uint32_t head = __atomic_load_n( &log->Head, __ATOMIC_ACQUIRE );
+
+		if ( ( head - log->Printed ) > LOG_ENTRIES )
+		{
+			uint32_t lost = head - log->Printed - LOG_ENTRIES;
+			log->Dropped += lost;
+			log->Printed = head - LOG_ENTRIES;
+			Serial.printf( "*** %u log lines dropped\n", lost );
+		}
+
+		// Stop at a line that is still being written, it will be printed next time
+		while ( ( log->Printed != head ) && log->ReadEntry( log->Printed, entry ) )
+		{
+			Serial.println( entry.text );
+			log->Printed++;
+		}
+
+		vTaskDelay( pdMS_TO_TICKS( 20 ) );
+	}
+}
+
+void HubLogger::Flush()
+{
+	if ( DrainTask != nullptr )
+	{
+		vTaskSuspend( DrainTask );
+	}
+
+	uint32_t head = __atomic_load_n( &Head, __ATOMIC_ACQUIRE );
+	if ( ( head - Printed ) > LOG_ENTRIES )
+	{
+		Printed = head - LOG_ENTRIES;
+	}
+
+	LOG_ENTRY entry;
+	for ( ; Printed != head; Printed++ )
+	{
+		if ( ReadEntry( Printed, entry ) )
+		{
+			Serial.println( entry.text );
+		}
+	}
+
+	Serial.flush();
+}
+
+uint32_t HubLogger::Dump( Print& Out, uint32_t Since )
+{
+	uint32_t head = __atomic_load_n( &Head, __ATOMIC_ACQUIRE );
+	uint32_t seq  = Since;
+	LOG_ENTRY entry;
+
+	// Start with the oldest line still in the ring, or from the start if the sequence is from before a reboot
+	if ( ( seq > head ) || ( ( head - seq ) > LOG_ENTRIES ) )
+	{
+		seq = ( head > LOG_ENTRIES ) ? ( head - LOG_ENTRIES ) : 0;
+	}
+
+	for ( ; seq != head; seq++ )
+	{
+		if ( ReadEntry( seq, entry ) )
+		{
+			Out.printf( "%u %lu %c %s\n", seq, entry.time, LevelNames[ entry.level < sizeof( LevelNames ) ? entry.level : 0 ], entry.text );
+		}
+	}
+
+	return head;
+}
@@ -0,0 +1,96 @@
+/*
+	<SwitchBotBLEHub:- Turn a ESP32 Arduio compatible board into a hub>
+	Copyright (C) <2020>  <Adrian Rockall>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARDUINO_HUB_LOG_H
+#define ARDUINO_HUB_LOG_H
+
+#include <Arduino.h>
+#include <stdint.h>
+
+#define LOG_LEVEL_NONE	0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN	2
+#define LOG_LEVEL_INFO	3
+#define LOG_LEVEL_DEBUG 4
+
+// Calls above this level are removed at compile time
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR( ... ) HubLog.Write( LOG_LEVEL_ERROR, __VA_ARGS__ )
+#else
+#define LOG_ERROR( ... ) do {} while ( 0 )
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN( ... ) HubLog.Write( LOG_LEVEL_WARN, __VA_ARGS__ )
+#else
+#define LOG_WARN( ... ) do {} while ( 0 )
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO( ... ) HubLog.Write( LOG_LEVEL_INFO, __VA_ARGS__ )
+#else
+#define LOG_INFO( ... ) do {} while ( 0 )
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG( ... ) HubLog.Write( LOG_LEVEL_DEBUG, __VA_ARGS__ )
+#else
+#define LOG_DEBUG( ... ) do {} while ( 0 )
+#endif
+
+#define LOG_ENTRIES	   64	  // Must be a power of 2
+#define LOG_LINE_SIZE 120	  // Longer lines are truncated
+
+typedef struct LOG_ENTRY
+{
+	volatile uint32_t seq;	  // Sequence number + 1 once the entry is complete, 0 while it is being written
+	unsigned long time;
+	uint8_t level;
+	char text[ LOG_LINE_SIZE ];
+};
+
+// Log lines are written to a RAM ring by any task without blocking and a low priority task copies them to the
+// serial port. When the ring is full the oldest lines are overwritten, even if they haven't been printed.
+class HubLogger
+{
+  private:
+	LOG_ENTRY Entries[ LOG_ENTRIES ];
+	volatile uint32_t Head;		 // Next sequence number to write
+	uint32_t Printed;			 // Next sequence number to print
+	uint32_t Dropped;			 // Lines overwritten before they were printed
+	TaskHandle_t DrainTask;
+	bool ReadEntry( uint32_t Seq, LOG_ENTRY& Entry );
+	static void Drain( void* Parameter );
+
+  public:
+	HubLogger();
+	~HubLogger();
+
+	void Begin( UBaseType_t Priority );	   // Start the task that prints to the serial port
+	void Write( uint8_t Level, const char* Format, ... ) __attribute__( ( format( printf, 3, 4 ) ) );
+	uint32_t Dump( Print& Out, uint32_t Since );	// Print the lines after Since still in the ring, returns the next sequence number
+	void Flush();									// Print what is left from the calling task and stop the drain task, for just before a reboot
+};
+
+extern HubLogger HubLog;
+
+#endif
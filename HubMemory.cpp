@@ -0,0 +1,94 @@
+/*
+	<SwitchBotBLEHub:- Turn a ESP32 Arduio compatible board into a hub>
+	Copyright (C) <2020>  <Adrian Rockall>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "HubLog.h"
+#include "HubMemory.h"
+#include <string.h>
+
+// Largest free block (bytes) below which each stage is entered. An HTTP callback needs about 16K.
+static const uint32_t StageThresholds[ NUM_MEMORY_STAGES ] = { 0, 24000, 16000, 10000 };
+static const uint32_t StageHysteresis					   = 4000;
+
+// Reboot if the heap hasn't recovered after this long in the critical stage (ms)
+static const unsigned long criticalRebootTime = 120000;
+
+static const char* const StageNames[ NUM_MEMORY_STAGES ] = { "normal", "constrained", "low", "critical" };
+
+MemoryGuard::MemoryGuard()
+{
+	Stage		 = MEM_NORMAL;
+	LargestBlock = 0;
+	LowestBlock	 = UINT32_MAX;
+	StageSince	 = 0;
+	Shed		 = 0;
+	memset( StageEntries, 0, sizeof( StageEntries ) );
+}
+
+MemoryGuard::~MemoryGuard()
+{
+}
+
+MemoryStage MemoryGuard::Update( uint32_t largestBlock, unsigned long t )
+{
+	LargestBlock = largestBlock;
+	if ( largestBlock < LowestBlock )
+	{
+		LowestBlock = largestBlock;
+	}
+
+	int stage = Stage;
+
+	// Go down as many stages as needed at once, but only come back up one at a time
+	while ( ( stage < ( NUM_MEMORY_STAGES - 1 ) ) && ( largestBlock < StageThresholds[ stage + 1 ] ) )
+	{
+		stage++;
+	}
+
+	if ( ( stage == Stage ) && ( stage > MEM_NORMAL ) && ( largestBlock > ( StageThresholds[ stage ] + StageHysteresis ) ) )
+	{
+		stage--;
+	}
+
+	if ( stage != Stage )
+	{
+		LOG_WARN( "Memory %s, largest free block %u", StageNames[ stage ], largestBlock );
+		Stage	   = ( MemoryStage ) stage;
+		StageSince = t;
+		StageEntries[ stage ]++;
+	}
+
+	return Stage;
+}
+
+bool MemoryGuard::ShouldReboot( unsigned long t )
+{
+	return ( Stage == MEM_CRITICAL ) && ( ( t - StageSince ) > criticalRebootTime );
+}
+
+void MemoryGuard::Write( Print& Out )
+{
+	Out.printf( "# HELP switchbot_memory_stage Load shedding stage, 0 is normal\n# TYPE switchbot_memory_stage gauge\nswitchbot_memory_stage %i\n", Stage );
+	Out.printf( "# HELP switchbot_memory_lowest_block_bytes Smallest largest free block seen\n# TYPE switchbot_memory_lowest_block_bytes gauge\nswitchbot_memory_lowest_block_bytes %u\n", LowestBlock );
+	Out.print( "# HELP switchbot_memory_stage_entries_total Times each load shedding stage was entered\n# TYPE switchbot_memory_stage_entries_total counter\n" );
+	for ( int i = MEM_CONSTRAINED; i < NUM_MEMORY_STAGES; i++ )
+	{
+		Out.printf( "switchbot_memory_stage_entries_total{stage=\"%s\"} %u\n", StageNames[ i ], StageEntries[ i ] );
+	}
+	Out.printf( "# HELP switchbot_memory_shed_total Requests and callbacks refused or deferred to save memory\n# TYPE switchbot_memory_shed_total counter\nswitchbot_memory_shed_total %u\n", Shed );
+}
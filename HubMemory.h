@@ -0,0 +1,64 @@
+/*
+	<SwitchBotBLEHub:- Turn a ESP32 Arduio compatible board into a hub>
+	Copyright (C) <2020>  <Adrian Rockall>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARDUINO_HUB_MEMORY_H
+#define ARDUINO_HUB_MEMORY_H
+
+#include <Arduino.h>
+#include <stdint.h>
+
+// Load shedding stages, each one includes the ones before it
+enum MemoryStage
+{
+	MEM_NORMAL,
+	MEM_CONSTRAINED,	// Callbacks for device changes are batched
+	MEM_LOW,			// Writes are refused with 503 and only urgent device changes are sent to callbacks
+	MEM_CRITICAL,		// Full table serialisation is refused too, reboot if it lasts
+	NUM_MEMORY_STAGES
+};
+
+// Watches the largest free heap block and decides how much work to shed. A stage is entered when the largest block
+// falls below its threshold and left when it rises above the threshold plus the hysteresis.
+class MemoryGuard
+{
+  private:
+	volatile MemoryStage Stage;
+	uint32_t LargestBlock;
+	uint32_t LowestBlock;
+	unsigned long StageSince;	   // millis() when the current stage was entered
+	uint32_t StageEntries[ NUM_MEMORY_STAGES ];
+	uint32_t Shed;				   // Requests and callbacks refused or deferred
+
+  public:
+	MemoryGuard();
+	~MemoryGuard();
+
+	MemoryStage Update( uint32_t largestBlock, unsigned long t );
+	MemoryStage GetStage()
+	{
+		return Stage;
+	};
+	bool ShouldReboot( unsigned long t );	  // Critical for too long, nothing left to shed
+	void CountShed()
+	{
+		__atomic_fetch_add( &Shed, 1, __ATOMIC_RELAXED );
+	};
+	void Write( Print& Out );	 // Prometheus text format
+};
+
+#endif
@@ -0,0 +1,227 @@
+/*
+	<SwitchBotBLEHub:- Turn a ESP32 Arduio compatible board into a hub>
+	Copyright (C) <2020>  <Adrian Rockall>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "HubMetrics.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char* const BootPhaseNames[ NUM_BOOT_PHASES ] = { "bleReady", "scanStarted", "firstDevice", "wifiConnected", "httpStarted", "setupDone", "firstCallback" };
+
+// Upper bounds (ms) of the callback latency buckets
+static const uint16_t LatencyBounds[ LATENCY_BUCKETS ] = { 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000 };
+
+HubMetrics::HubMetrics()
+{
+	memset( Models, 0, sizeof( Models ) );
+	memset( &CallbackLatency, 0, sizeof( CallbackLatency ) );
+	memset( &EventLatency, 0, sizeof( EventLatency ) );
+	memset( BootTimes, 0, sizeof( BootTimes ) );
+	Adverts			   = 0;
+	NoRoom			   = 0;
+	CallbackPosts	   = 0;
+	CallbackFailures   = 0;
+}
+
+HubMetrics::~HubMetrics()
+{
+}
+
+// Returns the counters for the model, claiming a free entry the first time the model is seen
+MODEL_COUNTERS* HubMetrics::FindModel( char model )
+{
+	for ( int i = 0; i < METRIC_MODELS; i++ )
+	{
+		char current = __atomic_load_n( &Models[ i ].model, __ATOMIC_ACQUIRE );
+		if ( current == 0 )
+		{
+			char expected = 0;
+			if ( __atomic_compare_exchange_n( &Models[ i ].model, &expected, model, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+			{
+				return &Models[ i ];
+			}
+			current = expected;	   // Another task claimed it first
+		}
+
+		if ( current == model )
+		{
+			return &Models[ i ];
+		}
+	}
+
+	return nullptr;
+}
+
+void HubMetrics::SwitchBotAdvert( char model, AdvertResult Result )
+{
+	// Anything that can't be used as a label value is counted together
+	if ( !isgraph( model ) || ( model == '"' ) || ( model == '\\' ) )
+	{
+		model = '?';
+	}
+
+	MODEL_COUNTERS* counters = FindModel( model );
+	if ( counters == nullptr )
+	{
+		return;
+	}
+
+	__atomic_fetch_add( &counters->seen, 1, __ATOMIC_RELAXED );
+	switch ( Result )
+	{
+		case ADVERT_ADDED:
+		case ADVERT_CHANGED:
+			__atomic_fetch_add( &counters->accepted, 1, __ATOMIC_RELAXED );
+			break;
+
+		case ADVERT_UNCHANGED:
+			__atomic_fetch_add( &counters->unchanged, 1, __ATOMIC_RELAXED );
+			break;
+
+		case ADVERT_NO_ROOM:
+			__atomic_fetch_add( &NoRoom, 1, __ATOMIC_RELAXED );
+			break;
+
+		default:
+			__atomic_fetch_add( &counters->invalid, 1, __ATOMIC_RELAXED );
+	}
+}
+
+static void RecordLatency( LATENCY_HISTOGRAM* Histogram, unsigned long Latency )
+{
+	int bucket = 0;
+	while ( ( bucket < LATENCY_BUCKETS ) && ( Latency > LatencyBounds[ bucket ] ) )
+	{
+		bucket++;
+	}
+
+	__atomic_fetch_add( &Histogram->buckets[ bucket ], 1, __ATOMIC_RELAXED );
+	__atomic_fetch_add( &Histogram->sum, ( uint32_t ) Latency, __ATOMIC_RELAXED );
+}
+
+static void WriteLatency( Print& Out, const char* Name, const char* Help, const LATENCY_HISTOGRAM* Histogram )
+{
+	Out.printf( "# HELP %s %s\n# TYPE %s histogram\n", Name, Help, Name );
+	uint32_t cumulative = 0;
+	for ( int i = 0; i < LATENCY_BUCKETS; i++ )
+	{
+		cumulative += Histogram->buckets[ i ];
+		Out.printf( "%s_bucket{le=\"%u\"} %u\n", Name, LatencyBounds[ i ], cumulative );
+	}
+	cumulative += Histogram->buckets[ LATENCY_BUCKETS ];
+	Out.printf( "%s_bucket{le=\"+Inf\"} %u\n", Name, cumulative );
+	Out.printf( "%s_sum %u\n%s_count %u\n", Name, Histogram->sum, Name, cumulative );
+}
+
+void HubMetrics::CallbackPost( bool Success, unsigned long Latency )
+{
+	__atomic_fetch_add( &CallbackPosts, 1, __ATOMIC_RELAXED );
+	if ( !Success )
+	{
+		__atomic_fetch_add( &CallbackFailures, 1, __ATOMIC_RELAXED );
+	}
+
+	RecordLatency( &CallbackLatency, Latency );
+}
+
+void HubMetrics::EventDelivered( unsigned long Latency )
+{
+	RecordLatency( &EventLatency, Latency );
+}
+
+void HubMetrics::BootPhaseReached( BootPhase Phase )
+{
+	uint32_t expected = 0;
+	__atomic_compare_exchange_n( &BootTimes[ Phase ], &expected, ( uint32_t ) millis(), false, __ATOMIC_RELAXED, __ATOMIC_RELAXED );
+}
+
+// {"phase":ms since boot,...}, phases not reached yet are null
+int HubMetrics::BootToJson( char* Buf, int BufSize )
+{
+	int bytes = snprintf( Buf, BufSize, "{" );
+	for ( int i = 0; ( i < NUM_BOOT_PHASES ) && ( bytes < BufSize ); i++ )
+	{
+		if ( BootTimes[ i ] != 0 )
+		{
+			bytes += snprintf( Buf + bytes, BufSize - bytes, "%s\"%s\":%u", i ? "," : "", BootPhaseNames[ i ], BootTimes[ i ] );
+		}
+		else
+		{
+			bytes += snprintf( Buf + bytes, BufSize - bytes, "%s\"%s\":null", i ? "," : "", BootPhaseNames[ i ] );
+		}
+	}
+
+	if ( bytes < BufSize )
+	{
+		bytes += snprintf( Buf + bytes, BufSize - bytes, "}" );
+	}
+
+	return bytes;
+}
+
+void WriteGauge( Print& Out, const char* Name, const char* Help, uint32_t Value )
+{
+	Out.printf( "# HELP %s %s\n# TYPE %s gauge\n%s %u\n", Name, Help, Name, Name, Value );
+}
+
+void WriteCounter( Print& Out, const char* Name, const char* Help, uint32_t Value )
+{
+	Out.printf( "# HELP %s %s\n# TYPE %s counter\n%s %u\n", Name, Help, Name, Name, Value );
+}
+
+void HubMetrics::Write( Print& Out )
+{
+	static const char* const ModelMetrics[] = { "seen", "accepted", "unchanged", "invalid" };
+
+	WriteCounter( Out, "switchbot_adverts_total", "BLE adverts reported by the scan", Adverts );
+
+	for ( int m = 0; m < 4; m++ )
+	{
+		Out.printf( "# HELP switchbot_model_adverts_%s_total SwitchBot adverts %s, by model\n", ModelMetrics[ m ], ModelMetrics[ m ] );
+		Out.printf( "# TYPE switchbot_model_adverts_%s_total counter\n", ModelMetrics[ m ] );
+
+		for ( int i = 0; i < METRIC_MODELS; i++ )
+		{
+			const MODEL_COUNTERS* counters = &Models[ i ];
+			if ( counters->model == 0 )
+			{
+				break;
+			}
+
+			const uint32_t values[] = { counters->seen, counters->accepted, counters->unchanged, counters->invalid };
+			Out.printf( "switchbot_model_adverts_%s_total{model=\"%c\"} %u\n", ModelMetrics[ m ], counters->model, values[ m ] );
+		}
+	}
+
+	WriteCounter( Out, "switchbot_adverts_no_room_total", "New devices dropped because the device table was full", NoRoom );
+	WriteCounter( Out, "switchbot_callback_posts_total", "Callback POSTs", CallbackPosts );
+	WriteCounter( Out, "switchbot_callback_failures_total", "Callback POSTs that failed or were refused", CallbackFailures );
+
+	WriteLatency( Out, "switchbot_callback_latency_ms", "Time to POST to a callback", &CallbackLatency );
+	WriteLatency( Out, "switchbot_event_latency_ms", "Time from an event device changing to the change reaching every callback", &EventLatency );
+
+	Out.print( "# HELP switchbot_boot_phase_ms Time after boot each start up phase was reached\n# TYPE switchbot_boot_phase_ms gauge\n" );
+	for ( int i = 0; i < NUM_BOOT_PHASES; i++ )
+	{
+		if ( BootTimes[ i ] != 0 )
+		{
+			Out.printf( "switchbot_boot_phase_ms{phase=\"%s\"} %u\n", BootPhaseNames[ i ], BootTimes[ i ] );
+		}
+	}
+}
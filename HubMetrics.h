@@ -0,0 +1,92 @@
+/*
+	<SwitchBotBLEHub:- Turn a ESP32 Arduio compatible board into a hub>
+	Copyright (C) <2020>  <Adrian Rockall>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARDUINO_HUB_METRICS_H
+#define ARDUINO_HUB_METRICS_H
+
+#include <Arduino.h>
+#include <stdint.h>
+#include "BLE_Device.h"
+
+#define METRIC_MODELS	 16
+#define LATENCY_BUCKETS 10	  // Latency histograms, see LatencyBounds
+
+typedef struct MODEL_COUNTERS
+{
+	char model;	   // 0 for a free entry
+	uint32_t seen;
+	uint32_t accepted;	  // Added or changed the device table
+	uint32_t unchanged;
+	uint32_t invalid;
+};
+
+// Milestones in starting up, each is recorded the first time it is reached
+enum BootPhase
+{
+	BOOT_BLE_READY,			// NimBLE initialised
+	BOOT_SCAN_STARTED,
+	BOOT_FIRST_DEVICE,		// First SwitchBot advert added to the device table
+	BOOT_WIFI_CONNECTED,
+	BOOT_HTTP_STARTED,
+	BOOT_SETUP_DONE,
+	BOOT_FIRST_CALLBACK,	// First device change accepted by a callback
+	NUM_BOOT_PHASES
+};
+
+typedef struct LATENCY_HISTOGRAM
+{
+	uint32_t buckets[ LATENCY_BUCKETS + 1 ];	// Last bucket is +Inf
+	uint32_t sum;								// ms
+};
+
+// Counters for the /metrics endpoint. They are only ever incremented with atomic adds so any task can update
+// them without a lock, the reader may see one counter updated before another.
+class HubMetrics
+{
+  private:
+	MODEL_COUNTERS Models[ METRIC_MODELS ];
+	uint32_t Adverts;			// Every advert reported by the scan
+	uint32_t NoRoom;			// SwitchBot adverts dropped because the device table was full
+	uint32_t CallbackPosts;
+	uint32_t CallbackFailures;
+	LATENCY_HISTOGRAM CallbackLatency;
+	LATENCY_HISTOGRAM EventLatency;	   // From an event device changing to its callbacks being sent the change
+	uint32_t BootTimes[ NUM_BOOT_PHASES ];	 // millis() when each phase was reached, 0 if it hasn't been
+	MODEL_COUNTERS* FindModel( char model );
+
+  public:
+	HubMetrics();
+	~HubMetrics();
+
+	void Advert()
+	{
+		__atomic_fetch_add( &Adverts, 1, __ATOMIC_RELAXED );
+	};
+	void SwitchBotAdvert( char model, AdvertResult Result );
+	void CallbackPost( bool Success, unsigned long Latency );
+	void EventDelivered( unsigned long Latency );
+	void BootPhaseReached( BootPhase Phase );
+	int BootToJson( char* Buf, int BufSize );
+	void Write( Print& Out );	 // Prometheus text format
+};
+
+// Prometheus text format helpers for values kept elsewhere
+void WriteGauge( Print& Out, const char* Name, const char* Help, uint32_t Value );
+void WriteCounter( Print& Out, const char* Name, const char* Help, uint32_t Value );
+
+#endif
@@ -0,0 +1,569 @@
+/*
+	<SwitchBotBLEHub:- Turn a ESP32 Arduio compatible board into a hub>
+	Copyright (C) <2020>  <Adrian Rockall>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "Arduino.h"
+#include "HubLog.h"
+#include "HubPeers.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char* const ReportHeader = "SwitchBot Hub RSSI ";
+
+static const unsigned long peerTimeout	 = 60000;	 // A peer, or what it said about a device, is forgotten after this (ms)
+static const unsigned long deviceTimeout = 60000;	 // We stop claiming a device we haven't heard for this long (ms)
+static const int ownershipHysteresis	 = 6;		 // dB better than the owner before a hub takes a device from it
+
+DeviceOwnership::DeviceOwnership()
+{
+	memset( Devices, 0, sizeof( Devices ) );
+	memset( Peers, 0, sizeof( Peers ) );
+	memset( LocalSlots, -1, sizeof( LocalSlots ) );
+	HubMAC[ 0 ]		= 0;
+	Mutex			= nullptr;
+	NextReport		= 0;
+	Taken			= 0;
+	Released		= 0;
+	ReportsReceived = 0;
+}
+
+DeviceOwnership::~DeviceOwnership()
+{
+}
+
+void DeviceOwnership::Begin( const char* hubMAC )
+{
+	strlcpy( HubMAC, hubMAC, sizeof( HubMAC ) );
+	if ( Mutex == nullptr )
+	{
+		Mutex = xSemaphoreCreateMutex();
+	}
+}
+
+// Returns the peer's entry, taking a free or forgotten one for a new peer. -1 if there's no room.
+int DeviceOwnership::FindPeer( const char* MAC, uint32_t ip, unsigned long t )
+{
+	int free = -1;
+	for ( int i = 0; i < PEER_HUBS; i++ )
+	{
+		if ( strcmp( Peers[ i ].MAC, MAC ) == 0 )
+		{
+			Peers[ i ].ip		 = ip;
+			Peers[ i ].lastHeard = t;
+			return i;
+		}
+
+		if ( ( free < 0 ) && !PeerLive( i, t ) )
+		{
+			free = i;
+		}
+	}
+
+	if ( free >= 0 )
+	{
+		LOG_INFO( "Peer hub %s joined", MAC );
+		strlcpy( Peers[ free ].MAC, MAC, sizeof( Peers[ free ].MAC ) );
+		Peers[ free ].ip		= ip;
+		Peers[ free ].lastHeard = t;
+		Peers[ free ].reports	= 0;
+		for ( int d = 0; d < PEER_DEVICES; d++ )
+		{
+			memset( &Devices[ d ].peers[ free ], 0, sizeof( PEER_RSSI ) );
+		}
+	}
+
+	return free;
+}
+
+// Returns the device's entry. With Claim a free entry is taken for a new device, or one only the peers knew about
+// and no longer hear. Our own devices (Local) can also push out one the peers still hear. -1 if there's no room.
+int DeviceOwnership::FindDevice( const char* MAC, bool Claim, bool Local, unsigned long t )
+{
+	int free   = -1;
+	int stale  = -1;
+	int remote = -1;
+	for ( int i = 0; i < PEER_DEVICES; i++ )
+	{
+		SHARED_DEVICE* device = &Devices[ i ];
+		if ( device->MAC[ 0 ] == 0 )
+		{
+			if ( free < 0 )
+			{
+				free = i;
+			}
+			continue;
+		}
+
+		if ( strcmp( device->MAC, MAC ) == 0 )
+		{
+			return i;
+		}
+
+		if ( device->local < 0 )
+		{
+			remote = i;
+
+			bool heard = false;
+			for ( int p = 0; ( p < PEER_HUBS ) && !heard; p++ )
+			{
+				heard = HeardByPeer( device, p, t );
+			}
+			if ( !heard )
+			{
+				stale = i;
+			}
+		}
+	}
+
+	if ( !Claim )
+	{
+		return -1;
+	}
+
+	int slot = ( free >= 0 ) ? free : ( stale >= 0 ) ? stale : Local ? remote : -1;
+	if ( slot >= 0 )
+	{
+		memset( &Devices[ slot ], 0, sizeof( SHARED_DEVICE ) );
+		strlcpy( Devices[ slot ].MAC, MAC, sizeof( Devices[ slot ].MAC ) );
+		Devices[ slot ].local = -1;
+	}
+
+	return slot;
+}
+
+bool DeviceOwnership::PeerLive( int Peer, unsigned long t )
+{
+	return ( Peers[ Peer ].MAC[ 0 ] != 0 ) && ( ( t - Peers[ Peer ].lastHeard ) < peerTimeout );
+}
+
+bool DeviceOwnership::HeardByPeer( const SHARED_DEVICE* Device, int Peer, unsigned long t )
+{
+	const PEER_RSSI* report = &Device->peers[ Peer ];
+	return PeerLive( Peer, t ) && ( report->heard != 0 ) && ( ( t - report->heard ) < peerTimeout ) && ( report->rssi != PEER_RSSI_UNHEARD );
+}
+
+// Stronger signal wins, the lower hub MAC breaks a tie so every hub reaches the same answer
+bool DeviceOwnership::Beats( int8_t Rssi, const char* MAC, int8_t OtherRssi, const char* OtherMAC )
+{
+	return ( Rssi > OtherRssi ) || ( ( Rssi == OtherRssi ) && ( strcmp( MAC, OtherMAC ) < 0 ) );
+}
+
+int8_t DeviceOwnership::OurRssi( const SHARED_DEVICE* Device, unsigned long t )
+{
+	if ( ( Device->local < 0 ) || ( Device->lastSeen == 0 ) || ( ( t - Device->lastSeen ) >= deviceTimeout ) )
+	{
+		return PEER_RSSI_UNHEARD;
+	}
+
+	return ( int8_t ) ( ( Device->smoothed - 8 ) / 16 );
+}
+
+void DeviceOwnership::Advert( uint8_t Index, const char* MAC, int rssi, unsigned long t )
+{
+	if ( ( Mutex == nullptr ) || ( Index >= MAX_DEVICES ) )
+	{
+		return;
+	}
+
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+
+	int slot = LocalSlots[ Index ];
+	if ( slot < 0 )
+	{
+		slot = FindDevice( MAC, true, true, t );
+		if ( slot < 0 )
+		{
+			xSemaphoreGive( Mutex );
+			return;
+		}
+
+		Devices[ slot ].local = Index;
+		LocalSlots[ Index ]	  = slot;
+	}
+
+	// Smooth out the swings of a single advert, starting from the first one
+	SHARED_DEVICE* device = &Devices[ slot ];
+	if ( device->lastSeen == 0 )
+	{
+		device->smoothed = rssi * 16;
+	}
+	else
+	{
+		device->smoothed += ( ( rssi * 16 ) - device->smoothed ) / 8;
+	}
+	device->lastSeen = t ? t : 1;
+
+	xSemaphoreGive( Mutex );
+}
+
+bool DeviceOwnership::IsOwner( uint8_t Index )
+{
+	if ( ( Mutex == nullptr ) || ( Index >= MAX_DEVICES ) || ( LocalSlots[ Index ] < 0 ) )
+	{
+		return true;
+	}
+
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+
+	unsigned long t		  = millis();
+	SHARED_DEVICE* device = &Devices[ LocalSlots[ Index ] ];
+	bool owner			  = device->owned;
+	if ( !owner )
+	{
+		// Report it until some hub claims it
+		owner = true;
+		for ( int p = 0; ( p < PEER_HUBS ) && owner; p++ )
+		{
+			owner = !( HeardByPeer( device, p, t ) && device->peers[ p ].claimed );
+		}
+	}
+
+	xSemaphoreGive( Mutex );
+	return owner;
+}
+
+// The devices we take are returned so their current state can be sent, their changes were dropped while another hub
+// owned them. The caller marks them, AllToJson holds the device table while it asks IsOwner so we can't do it here.
+int DeviceOwnership::Elect( unsigned long t, uint8_t* TakenIndexes )
+{
+	if ( Mutex == nullptr )
+	{
+		return 0;
+	}
+
+	int taken = 0;
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+
+	for ( int i = 0; i < PEER_DEVICES; i++ )
+	{
+		SHARED_DEVICE* device = &Devices[ i ];
+		if ( device->local < 0 )
+		{
+			continue;
+		}
+
+		// The strongest peer and the strongest peer that claims it
+		int best	 = -1;
+		int claimant = -1;
+		for ( int p = 0; p < PEER_HUBS; p++ )
+		{
+			if ( !HeardByPeer( device, p, t ) )
+			{
+				continue;
+			}
+
+			if ( ( best < 0 ) || Beats( device->peers[ p ].rssi, Peers[ p ].MAC, device->peers[ best ].rssi, Peers[ best ].MAC ) )
+			{
+				best = p;
+			}
+
+			if ( device->peers[ p ].claimed &&
+				 ( ( claimant < 0 ) || Beats( device->peers[ p ].rssi, Peers[ p ].MAC, device->peers[ claimant ].rssi, Peers[ claimant ].MAC ) ) )
+			{
+				claimant = p;
+			}
+		}
+
+		int8_t rssi = OurRssi( device, t );
+		bool owned	= device->owned;
+		if ( rssi == PEER_RSSI_UNHEARD )
+		{
+			owned = false;
+		}
+		else if ( owned )
+		{
+			// Only let go once a better hub has claimed it, so there's no gap. Two owners sort it out between them.
+			if ( ( claimant >= 0 ) && Beats( device->peers[ claimant ].rssi, Peers[ claimant ].MAC, rssi, HubMAC ) )
+			{
+				owned = false;
+			}
+		}
+		else if ( claimant >= 0 )
+		{
+			owned = rssi > ( device->peers[ claimant ].rssi + ownershipHysteresis );
+		}
+		else
+		{
+			owned = ( best < 0 ) || Beats( rssi, HubMAC, device->peers[ best ].rssi, Peers[ best ].MAC );
+		}
+
+		if ( owned != device->owned )
+		{
+			LOG_DEBUG( "%s %s, RSSI %i", owned ? "Taking" : "Releasing", device->MAC, rssi );
+			device->owned = owned;
+			if ( owned )
+			{
+				Taken++;
+				if ( ( device->local < MAX_DEVICES ) && ( taken < MAX_DEVICES ) )
+				{
+					TakenIndexes[ taken++ ] = device->local;
+				}
+			}
+			else
+			{
+				Released++;
+			}
+		}
+	}
+
+	xSemaphoreGive( Mutex );
+	return taken;
+}
+
+// SwitchBot Hub RSSI <hub MAC> <device MAC>,<rssi>,<claimed> ... with a few devices in each report
+int DeviceOwnership::BuildReport( char* Buf, int BufSize, unsigned long t )
+{
+	if ( Mutex == nullptr )
+	{
+		return 0;
+	}
+
+	int bytes = snprintf( Buf, BufSize, "%s%s", ReportHeader, HubMAC );
+	int added = 0;
+
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+
+	for ( int n = 0; ( n < PEER_DEVICES ) && ( added < PEER_REPORT_DEVICES ); n++ )
+	{
+		SHARED_DEVICE* device = &Devices[ NextReport ];
+		if ( ( device->local >= 0 ) && ( device->lastSeen != 0 ) )
+		{
+			int entryBytes = snprintf( Buf + bytes, BufSize - bytes, " %s,%i,%i", device->MAC, OurRssi( device, t ), device->owned );
+			if ( entryBytes >= ( BufSize - bytes ) )
+			{
+				break;	  // The rest go in the next report
+			}
+
+			bytes += entryBytes;
+			added++;
+		}
+
+		NextReport = ( NextReport + 1 ) % PEER_DEVICES;
+	}
+
+	xSemaphoreGive( Mutex );
+
+	return added ? bytes : 0;
+}
+
+bool DeviceOwnership::HandleReport( const char* Packet, uint32_t ip, unsigned long t )
+{
+	size_t headerLength = strlen( ReportHeader );
+	if ( ( Mutex == nullptr ) || ( strncmp( Packet, ReportHeader, headerLength ) != 0 ) )
+	{
+		return false;
+	}
+
+	const char* next = Packet + headerLength;
+	char hubMAC[ 18 ];
+	if ( ( sscanf( next, "%17s", hubMAC ) != 1 ) || ( strcmp( hubMAC, HubMAC ) == 0 ) )
+	{
+		return true;	// Our own report looped back
+	}
+	next += strlen( hubMAC );
+
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+
+	int peer = FindPeer( hubMAC, ip, t );
+	if ( peer >= 0 )
+	{
+		Peers[ peer ].reports++;
+		ReportsReceived++;
+
+		char mac[ 18 ];
+		int rssi;
+		int claimed;
+		int length;
+		while ( sscanf( next, " %17[^,],%i,%i%n", mac, &rssi, &claimed, &length ) == 3 )
+		{
+			next += length;
+
+			int slot = FindDevice( mac, true, false, t );
+			if ( slot >= 0 )
+			{
+				PEER_RSSI* report = &Devices[ slot ].peers[ peer ];
+				report->rssi	  = ( int8_t ) ( ( rssi < PEER_RSSI_UNHEARD ) ? PEER_RSSI_UNHEARD : ( rssi > 20 ) ? 20 : rssi );
+				report->claimed	  = claimed != 0;
+				report->heard	  = t ? t : 1;
+			}
+		}
+	}
+
+	xSemaphoreGive( Mutex );
+	return true;
+}
+
+int DeviceOwnership::GetLivePeers( unsigned long t )
+{
+	int live = 0;
+	for ( int i = 0; i < PEER_HUBS; i++ )
+	{
+		if ( PeerLive( i, t ) )
+		{
+			live++;
+		}
+	}
+
+	return live;
+}
+
+bool DeviceOwnership::IsPeer( uint32_t ip, unsigned long t )
+{
+	if ( Mutex == nullptr )
+	{
+		return false;
+	}
+
+	bool found = false;
+
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+	for ( int i = 0; ( i < PEER_HUBS ) && !found; i++ )
+	{
+		found = PeerLive( i, t ) && ( Peers[ i ].ip == ip );
+	}
+	xSemaphoreGive( Mutex );
+
+	return found;
+}
+
+bool DeviceOwnership::FindBestPeer( const char* MAC, unsigned long t, uint32_t* ip, char* PeerMAC )
+{
+	if ( Mutex == nullptr )
+	{
+		return false;
+	}
+
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+
+	int best = -1;
+	for ( int i = 0; i < PEER_DEVICES; i++ )
+	{
+		SHARED_DEVICE* device = &Devices[ i ];
+		if ( ( device->MAC[ 0 ] == 0 ) || ( strcasecmp( device->MAC, MAC ) != 0 ) )
+		{
+			continue;
+		}
+
+		for ( int p = 0; p < PEER_HUBS; p++ )
+		{
+			if ( HeardByPeer( device, p, t ) &&
+				 ( ( best < 0 ) || Beats( device->peers[ p ].rssi, Peers[ p ].MAC, device->peers[ best ].rssi, Peers[ best ].MAC ) ) )
+			{
+				best = p;
+			}
+		}
+		break;
+	}
+
+	if ( best >= 0 )
+	{
+		*ip = Peers[ best ].ip;
+		strlcpy( PeerMAC, Peers[ best ].MAC, 18 );
+	}
+
+	xSemaphoreGive( Mutex );
+	return best >= 0;
+}
+
+// Room is kept for the closing brackets, so peers and devices that don't fit are left out but the JSON is whole.
+// Returns 0 if not even the header fits.
+int DeviceOwnership::PeersToJson( char* Buf, int BufSize, unsigned long t )
+{
+	if ( Mutex == nullptr )
+	{
+		return 0;
+	}
+
+	static const char* const ownedHeader = "],\"owned\":[";
+	int ownedEnd = BufSize - 2;	   // Leaves room for ]}
+	int peersEnd = ownedEnd - strlen( ownedHeader );
+
+	int bytes = snprintf( Buf, BufSize, "{\"hubMAC\":\"%s\",\"peers\":[", HubMAC );
+	if ( bytes >= peersEnd )
+	{
+		return 0;
+	}
+
+	xSemaphoreTake( Mutex, portMAX_DELAY );
+
+	bool first = true;
+	for ( int i = 0; i < PEER_HUBS; i++ )
+	{
+		if ( !PeerLive( i, t ) )
+		{
+			continue;
+		}
+
+		uint32_t ip	   = Peers[ i ].ip;
+		int entryBytes = snprintf( Buf + bytes, peersEnd - bytes, "%s{\"hubMAC\":\"%s\",\"ip\":\"%u.%u.%u.%u\",\"age\":%lu,\"reports\":%u}",
+								   first ? "" : ",", Peers[ i ].MAC, ip & 0xFF, ( ip >> 8 ) & 0xFF, ( ip >> 16 ) & 0xFF, ip >> 24, t - Peers[ i ].lastHeard, Peers[ i ].reports );
+		if ( entryBytes >= ( peersEnd - bytes ) )
+		{
+			break;
+		}
+
+		bytes += entryBytes;
+		first = false;
+	}
+
+	bytes += snprintf( Buf + bytes, BufSize - bytes, "%s", ownedHeader );
+
+	first = true;
+	for ( int i = 0; i < PEER_DEVICES; i++ )
+	{
+		if ( !Devices[ i ].owned )
+		{
+			continue;
+		}
+
+		int entryBytes = snprintf( Buf + bytes, ownedEnd - bytes, "%s\"%s\"", first ? "" : ",", Devices[ i ].MAC );
+		if ( entryBytes >= ( ownedEnd - bytes ) )
+		{
+			break;
+		}
+
+		bytes += entryBytes;
+		first = false;
+	}
+
+	xSemaphoreGive( Mutex );
+
+	bytes += snprintf( Buf + bytes, BufSize - bytes, "]}" );
+	return bytes;
+}
+
+void DeviceOwnership::Write( Print& Out )
+{
+	unsigned long t = millis();
+	int owned		= 0;
+	for ( int i = 0; i < PEER_DEVICES; i++ )
+	{
+		if ( Devices[ i ].owned )
+		{
+			owned++;
+		}
+	}
+
+	Out.printf( "# HELP switchbot_peer_hubs Other hubs heard from recently\n# TYPE switchbot_peer_hubs gauge\nswitchbot_peer_hubs %i\n", GetLivePeers( t ) );
+	Out.printf( "# HELP switchbot_owned_devices Devices this hub reports to its callbacks\n# TYPE switchbot_owned_devices gauge\nswitchbot_owned_devices %i\n", owned );
+	Out.print( "# HELP switchbot_ownership_changes_total Devices taken from or released to other hubs\n# TYPE switchbot_ownership_changes_total counter\n" );
+	Out.printf( "switchbot_ownership_changes_total{change=\"taken\"} %u\n", Taken );
+	Out.printf( "switchbot_ownership_changes_total{change=\"released\"} %u\n", Released );
+	Out.printf( "# HELP switchbot_peer_reports_total RSSI reports received from other hubs\n# TYPE switchbot_peer_reports_total counter\nswitchbot_peer_reports_total %u\n", ReportsReceived );
+}
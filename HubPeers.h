@@ -0,0 +1,99 @@
+/*
+	<SwitchBotBLEHub:- Turn a ESP32 Arduio compatible board into a hub>
+	Copyright (C) <2020>  <Adrian Rockall>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef ARDUINO_HUB_PEERS_H
+#define ARDUINO_HUB_PEERS_H
+
+#include "BLE_Device.h"
+#include <Arduino.h>
+#include <stdint.h>
+
+#define PEER_HUBS			4	  // Other hubs that can be tracked
+#define PEER_DEVICES		( MAX_DEVICES + 14 )	// Our devices and some only the peers hear
+#define PEER_REPORT_DEVICES 20	  // Most devices in one multicast report
+#define PEER_RSSI_UNHEARD	-127	  // Reported for a device the hub has stopped hearing
+#define PEER_REPORT_SIZE	600	  // Room for a report of PEER_REPORT_DEVICES, no bigger than DISCOVERY_SIZE
+
+typedef struct PEER_HUB
+{
+	char MAC[ 18 ];	  // Empty for a free entry
+	uint32_t ip;
+	unsigned long lastHeard;
+	uint32_t reports;
+};
+
+// What one peer last said about a device
+typedef struct PEER_RSSI
+{
+	int8_t rssi;	  // Smoothed, dBm
+	bool claimed;	  // The peer sends this device's changes to its callbacks
+	unsigned long heard;
+};
+
+typedef struct SHARED_DEVICE
+{
+	char MAC[ 18 ];		  // Empty for a free entry
+	int local;			  // Index in our device table, -1 if only the peers hear it
+	int16_t smoothed;	  // Our RSSI in 1/16 dBm
+	unsigned long lastSeen;
+	bool owned;			  // We send this device's changes to our callbacks
+	PEER_RSSI peers[ PEER_HUBS ];
+};
+
+// Hubs in range of the same devices share their smoothed RSSI for each one over the discovery multicast group and
+// elect a single owner per device, so only one hub sends its changes to the callbacks. The other hubs keep
+// ingesting so they can take over. A hub only takes a device from its owner when the signal is better by the
+// hysteresis margin, and while no hub claims a device every hub reports it.
+class DeviceOwnership
+{
+  private:
+	SHARED_DEVICE Devices[ PEER_DEVICES ];
+	int8_t LocalSlots[ MAX_DEVICES ];	 // Entry in Devices for each index in our device table, -1 if none
+	PEER_HUB Peers[ PEER_HUBS ];
+	char HubMAC[ 18 ];
+	SemaphoreHandle_t Mutex;
+	int NextReport;	   // Entry the next report starts from
+	uint32_t Taken;
+	uint32_t Released;
+	uint32_t ReportsReceived;
+	int FindPeer( const char* MAC, uint32_t ip, unsigned long t );
+	int FindDevice( const char* MAC, bool Claim, bool Local, unsigned long t );
+	bool PeerLive( int Peer, unsigned long t );
+	bool HeardByPeer( const SHARED_DEVICE* Device, int Peer, unsigned long t );
+	bool Beats( int8_t Rssi, const char* MAC, int8_t OtherRssi, const char* OtherMAC );
+	int8_t OurRssi( const SHARED_DEVICE* Device, unsigned long t );
+
+  public:
+	DeviceOwnership();
+	~DeviceOwnership();
+
+	void Begin( const char* hubMAC );
+	void Advert( uint8_t Index, const char* MAC, int rssi, unsigned long t );	 // Call for each advert we ingest
+	bool IsOwner( uint8_t Index );		   // Should our callbacks get this device's changes
+	int Elect( unsigned long t, uint8_t* TakenIndexes );	// Take and release devices using the latest reports, returns how many of our devices were taken. TakenIndexes needs room for MAX_DEVICES.
+	int BuildReport( char* Buf, int BufSize, unsigned long t );	   // The next part of our report, 0 if there's nothing to send
+	bool HandleReport( const char* Packet, uint32_t ip, unsigned long t );	  // Packet must be NUL terminated, false if it isn't a report
+	int GetLivePeers( unsigned long t );
+	bool IsPeer( uint32_t ip, unsigned long t );	// A hub we've heard from recently has this address
+	bool FindBestPeer( const char* MAC, unsigned long t, uint32_t* ip, char* PeerMAC );	   // The peer with the best signal from a device, PeerMAC needs 18 bytes
+	int PeersToJson( char* Buf, int BufSize, unsigned long t );
+	void Write( Print& Out );	 // Prometheus text format
+};
+
+#endif
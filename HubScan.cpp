@@ -0,0 +1,253 @@
+/*
+	<SwitchBotBLEHub:- Turn a ESP32 Arduio compatible board into a hub>
+	Copyright (C) <2020>  <Adrian Rockall>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "HubLog.h"
+#include "HubScan.h"
+#include <string.h>
+
+// Interval and window for each level, from about 10% to 95% of the time listening. Level 1 is where the hub starts.
+static const SCAN_SETTINGS ScanLevels[ SCAN_LEVELS ] = { { 1000, 100, true }, { 510, 200, true }, { 320, 200, true }, { 160, 130, true }, { 100, 95, true } };
+
+// How often the level is reconsidered (ms)
+static const unsigned long scanPeriod = 10000;
+
+// Missed adverts (per thousand) above which the level goes up and below which it goes down
+static const uint16_t missRateHigh = 200;
+static const uint16_t missRateLow  = 50;
+
+// Event devices that haven't been heard for this long (ms) no longer keep the scan at the top level
+static const unsigned long eventDeviceTimeout = 600000;
+
+// Active bursts: how long they last, how often new devices are looked for, how old a scan response can get
+// and how close together bursts for the scan responses can be (ms)
+static const unsigned long activeBurstTime	 = 10000;
+static const unsigned long discoveryInterval = 300000;
+static const unsigned long responseMaxAge	 = 120000;
+static const unsigned long minBurstGap		 = 30000;
+
+// Adverts closer together than this (ms) are repeats on the other advertising channels, not new adverts
+static const unsigned long minAdvertGap = 20;
+
+ScanScheduler::ScanScheduler()
+{
+	memset( Devices, 0, sizeof( Devices ) );
+	Level		  = 1;
+	EventDevices  = false;
+	Adverts		  = 0;
+	AdvertRate	  = 0;
+	MissRate	  = 0;
+	PeriodStart	  = 0;
+	Changes		  = 0;
+	Selective	  = false;
+	Active		  = true;
+	ActiveUntil	  = 0;
+	NextBurst	  = 0;
+	NextDiscovery = 0;	  // Straight away, to find the devices after boot
+	Bursts		  = 0;
+	Lock		  = portMUX_INITIALIZER_UNLOCKED;
+}
+
+ScanScheduler::~ScanScheduler()
+{
+}
+
+void ScanScheduler::Begin( bool SelectiveActive )
+{
+	Selective = SelectiveActive;
+}
+
+void ScanScheduler::Advert( int Index, char Model, bool ManufacturerData, unsigned long t )
+{
+	if ( ( Index < 0 ) || ( Index >= MAX_DEVICES ) )
+	{
+		return;
+	}
+
+	portENTER_CRITICAL( &Lock );
+	SCAN_DEVICE* device = &Devices[ Index ];
+	unsigned long gap	= t - device->lastSeen;
+
+	Adverts++;
+	device->model = Model;
+	if ( ManufacturerData )
+	{
+		device->lastResponse = t;
+	}
+	if ( device->lastSeen == 0 )
+	{
+		device->received++;
+		device->expected++;
+		device->lastSeen = t;
+	}
+	else if ( gap >= minAdvertGap )
+	{
+		if ( ( device->minGap == 0 ) || ( gap < device->minGap ) )
+		{
+			device->minGap = gap;
+		}
+
+		device->received++;
+		device->expected += ( gap + ( device->minGap / 2 ) ) / device->minGap;
+		device->lastSeen = t;
+	}
+	portEXIT_CRITICAL( &Lock );
+}
+
+// Starts and ends the active bursts
+bool ScanScheduler::UpdateActive( unsigned long t )
+{
+	bool active = true;
+
+	if ( Selective && ( ( long ) ( t - ActiveUntil ) >= 0 ) )
+	{
+		bool burst = false;
+
+		if ( ( long ) ( t - NextDiscovery ) >= 0 )
+		{
+			NextDiscovery = t + discoveryInterval;
+			burst		  = true;
+		}
+		else if ( ( long ) ( t - NextBurst ) >= 0 )
+		{
+			portENTER_CRITICAL( &Lock );
+			for ( int i = 0; i < MAX_DEVICES; i++ )
+			{
+				if ( ( Devices[ i ].lastSeen != 0 ) && NeedsScanResponse( Devices[ i ].model ) && ( ( t - Devices[ i ].lastResponse ) > responseMaxAge ) )
+				{
+					burst = true;
+					break;
+				}
+			}
+			portEXIT_CRITICAL( &Lock );
+		}
+
+		if ( burst )
+		{
+			ActiveUntil = t + activeBurstTime;
+			NextBurst	= t + minBurstGap;
+			Bursts++;
+		}
+		else
+		{
+			active = false;
+		}
+	}
+
+	if ( active == Active )
+	{
+		return false;
+	}
+
+	LOG_DEBUG( "Scan %s", active ? "active" : "passive" );
+	Active = active;
+	return true;
+}
+
+bool ScanScheduler::Update( unsigned long t, int PendingCommands )
+{
+	bool changed = UpdateActive( t );
+
+	if ( ( t - PeriodStart ) < scanPeriod )
+	{
+		return changed;
+	}
+
+	uint32_t received = 0;
+	uint32_t expected = 0;
+	bool eventDevices = false;
+
+	portENTER_CRITICAL( &Lock );
+	for ( int i = 0; i < MAX_DEVICES; i++ )
+	{
+		SCAN_DEVICE* device = &Devices[ i ];
+		if ( device->lastSeen == 0 )
+		{
+			continue;
+		}
+
+		received += device->received;
+		expected += device->expected;
+		if ( IsEventModel( device->model ) && ( ( t - device->lastSeen ) < eventDeviceTimeout ) )
+		{
+			eventDevices = true;
+		}
+
+		// Let the interval drift back up so one burst of adverts doesn't count as missed ones forever
+		device->minGap += device->minGap / 8;
+		device->received = 0;
+		device->expected = 0;
+	}
+
+	AdvertRate = ( Adverts * 60000 ) / ( t - PeriodStart );
+	Adverts	   = 0;
+	portEXIT_CRITICAL( &Lock );
+
+	PeriodStart	 = t;
+	MissRate	 = ( expected > received ) ? ( ( expected - received ) * 1000 ) / expected : 0;
+	EventDevices = eventDevices;
+
+	int level = Level;
+	if ( eventDevices )
+	{
+		level = SCAN_LEVELS - 1;
+	}
+	else if ( ( MissRate > missRateHigh ) && ( level < ( SCAN_LEVELS - 1 ) ) )
+	{
+		level++;
+	}
+	else if ( ( MissRate < missRateLow ) && ( level > 0 ) )
+	{
+		level--;
+	}
+
+	// Connections need some of the radio time
+	if ( ( PendingCommands > 0 ) && ( level > ( SCAN_LEVELS - 2 ) ) )
+	{
+		level = SCAN_LEVELS - 2;
+	}
+
+	if ( level == Level )
+	{
+		return changed;
+	}
+
+	LOG_INFO( "Scan level %i, interval %u window %u, missed %u/1000", level, ScanLevels[ level ].interval, ScanLevels[ level ].window, MissRate );
+	Level = level;
+	Changes++;
+	return true;
+}
+
+SCAN_SETTINGS ScanScheduler::GetSettings()
+{
+	SCAN_SETTINGS settings = ScanLevels[ Level ];
+	settings.active		   = Active;
+	return settings;
+}
+
+void ScanScheduler::Write( Print& Out )
+{
+	Out.printf( "# HELP switchbot_scan_interval_ms Scan interval\n# TYPE switchbot_scan_interval_ms gauge\nswitchbot_scan_interval_ms %u\n", ScanLevels[ Level ].interval );
+	Out.printf( "# HELP switchbot_scan_window_ms Time the radio listens in each scan interval\n# TYPE switchbot_scan_window_ms gauge\nswitchbot_scan_window_ms %u\n", ScanLevels[ Level ].window );
+	Out.printf( "# HELP switchbot_scan_missed_ratio Estimated share of SwitchBot adverts missed\n# TYPE switchbot_scan_missed_ratio gauge\nswitchbot_scan_missed_ratio %.3f\n", MissRate / 1000.0 );
+	Out.printf( "# HELP switchbot_scan_adverts_per_minute SwitchBot adverts received\n# TYPE switchbot_scan_adverts_per_minute gauge\nswitchbot_scan_adverts_per_minute %u\n", AdvertRate );
+	Out.printf( "# HELP switchbot_scan_event_devices Event devices are in range\n# TYPE switchbot_scan_event_devices gauge\nswitchbot_scan_event_devices %i\n", EventDevices ? 1 : 0 );
+	Out.printf( "# HELP switchbot_scan_active Scan asks for scan responses\n# TYPE switchbot_scan_active gauge\nswitchbot_scan_active %i\n", Active ? 1 : 0 );
+	Out.printf( "# HELP switchbot_scan_active_bursts_total Active scan bursts while scanning selectively\n# TYPE switchbot_scan_active_bursts_total counter\nswitchbot_scan_active_bursts_total %u\n", Bursts );
+	Out.printf( "# HELP switchbot_scan_changes_total Times the scan settings changed\n# TYPE switchbot_scan_changes_total counter\nswitchbot_scan_changes_total %u\n", Changes );
+}
@@ -0,0 +1,81 @@
+/*
+	<SwitchBotBLEHub:- Turn a ESP32 Arduio compatible board into a hub>
+	Copyright (C) <2020>  <Adrian Rockall>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARDUINO_HUB_SCAN_H
+#define ARDUINO_HUB_SCAN_H
+
+#include "BLE_Device.h"
+#include <Arduino.h>
+#include <stdint.h>
+
+#define SCAN_LEVELS 5	 // See ScanLevels in HubScan.cpp
+
+typedef struct SCAN_SETTINGS
+{
+	uint16_t interval;	  // ms
+	uint16_t window;	  // ms the radio listens for in each interval
+	bool active;		  // Ask for scan responses
+};
+
+typedef struct SCAN_DEVICE
+{
+	char model;
+	unsigned long lastSeen;
+	unsigned long minGap;	 // Shortest time between adverts, taken as the device's advertising interval
+	unsigned long lastResponse;	// Last advert with manufacturer data
+	uint16_t received;		 // Adverts this period
+	uint16_t expected;		 // Adverts the device should have sent this period
+};
+
+// Chooses how much of the time the radio scans. It goes up a level when too many adverts are being missed and down
+// when hardly any are, goes straight to the top when event devices are about and holds back a little while commands
+// need the radio to connect. The ingest task reports the adverts, the housekeeping task calls Update.
+// With selective active scanning the scan is passive except for short active bursts, to discover new devices or when
+// a device whose model needs the scan response hasn't sent one for a while.
+class ScanScheduler
+{
+  private:
+	SCAN_DEVICE Devices[ MAX_DEVICES ];
+	uint8_t Level;
+	bool EventDevices;
+	uint32_t Adverts;			  // SwitchBot adverts this period
+	uint32_t AdvertRate;		  // Per minute, last period
+	uint16_t MissRate;			  // Per thousand, last period
+	unsigned long PeriodStart;
+	uint32_t Changes;
+	bool Selective;
+	bool Active;
+	unsigned long ActiveUntil;	  // End of the current active burst
+	unsigned long NextBurst;	  // Earliest time for a burst for the scan responses
+	unsigned long NextDiscovery;
+	uint32_t Bursts;
+	bool UpdateActive( unsigned long t );
+	portMUX_TYPE Lock;
+
+  public:
+	ScanScheduler();
+	~ScanScheduler();
+
+	void Begin( bool SelectiveActive );
+	void Advert( int Index, char Model, bool ManufacturerData, unsigned long t );
+	bool Update( unsigned long t, int PendingCommands );	// True when the scan settings have changed
+	SCAN_SETTINGS GetSettings();
+	void Write( Print& Out );	 // Prometheus text format
+};
+
+#endif
@@ -0,0 +1,123 @@
+/*
+	<SwitchBotBLEHub:- Turn a ESP32 Arduio compatible board into a hub>
+	Copyright (C) <2020>  <Adrian Rockall>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "Arduino.h"
+#include "HubTasks.h"
+#include <esp_timer.h>
+#include <string.h>
+
+HubTasks::HubTasks()
+{
+	static const char* const names[ NUM_HUB_TASKS ]		  = { "ingest", "command", "worker", "callback", "event", "housekeeping", "forward" };
+	static const uint32_t stackSizes[ NUM_HUB_TASKS ]	  = { 4096, 4096, 6144, 8192, 8192, 4096, 6144 };
+	static const BaseType_t cores[ NUM_HUB_TASKS ]		  = { INGEST_TASK_CORE, COMMAND_TASK_CORE, COMMAND_TASK_CORE, CALLBACK_TASK_CORE, EVENT_TASK_CORE, HOUSEKEEPING_TASK_CORE, FORWARD_TASK_CORE };
+	static const UBaseType_t priorities[ NUM_HUB_TASKS ] = { INGEST_TASK_PRIORITY, COMMAND_TASK_PRIORITY, COMMAND_TASK_PRIORITY, CALLBACK_TASK_PRIORITY, EVENT_TASK_PRIORITY, HOUSEKEEPING_TASK_PRIORITY, FORWARD_TASK_PRIORITY };
+
+	memset( Tasks, 0, sizeof( Tasks ) );
+	for ( int i = 0; i < NUM_HUB_TASKS; i++ )
+	{
+		Tasks[ i ].name		 = names[ i ];
+		Tasks[ i ].stackSize = stackSizes[ i ];
+		Tasks[ i ].core		 = cores[ i ];
+		Tasks[ i ].priority	 = priorities[ i ];
+	}
+
+	Lock = portMUX_INITIALIZER_UNLOCKED;
+}
+
+HubTasks::~HubTasks()
+{
+}
+
+BaseType_t HubTasks::GetCore( HubTaskId Id )
+{
+#if portNUM_PROCESSORS > 1
+	if ( ( Tasks[ Id ].core >= 0 ) && ( Tasks[ Id ].core < portNUM_PROCESSORS ) )
+	{
+		return Tasks[ Id ].core;
+	}
+#endif
+	return tskNO_AFFINITY;
+}
+
+bool HubTasks::Start( HubTaskId Id, TaskFunction_t Function, void* Param )
+{
+	HUB_TASK* task = &Tasks[ Id ];
+	if ( task->handle != nullptr )
+	{
+		return true;
+	}
+
+	return xTaskCreatePinnedToCore( Function, task->name, task->stackSize, Param, task->priority, &task->handle, GetCore( Id ) ) == pdPASS;
+}
+
+int64_t HubTasks::Working( HubTaskId Id )
+{
+	__atomic_fetch_add( &Tasks[ Id ].wakeups, 1, __ATOMIC_RELAXED );
+	return esp_timer_get_time();
+}
+
+void HubTasks::Done( HubTaskId Id, int64_t Start )
+{
+	uint64_t elapsed = esp_timer_get_time() - Start;
+
+	portENTER_CRITICAL( &Lock );
+	Tasks[ Id ].busyTime += elapsed;
+	portEXIT_CRITICAL( &Lock );
+}
+
+void HubTasks::Write( Print& Out )
+{
+	uint64_t busyTime[ NUM_HUB_TASKS ];
+
+	portENTER_CRITICAL( &Lock );
+	for ( int i = 0; i < NUM_HUB_TASKS; i++ )
+	{
+		busyTime[ i ] = Tasks[ i ].busyTime;
+	}
+	portEXIT_CRITICAL( &Lock );
+
+	Out.print( "# HELP switchbot_task_info Core (-1 for any) and priority of each hub task\n# TYPE switchbot_task_info gauge\n" );
+	for ( int i = 0; i < NUM_HUB_TASKS; i++ )
+	{
+		BaseType_t core = GetCore( ( HubTaskId ) i );
+		Out.printf( "switchbot_task_info{task=\"%s\",core=\"%i\",priority=\"%u\"} 1\n", Tasks[ i ].name, ( core == tskNO_AFFINITY ) ? -1 : core, Tasks[ i ].priority );
+	}
+
+	// Wall time, not CPU time: a task blocked on an HTTP POST, a BLE connect or a mutex still counts as busy
+	Out.print( "# HELP switchbot_task_busy_wall_seconds_total Wall time each hub task spent handling work, including waits for I/O\n# TYPE switchbot_task_busy_wall_seconds_total counter\n" );
+	for ( int i = 0; i < NUM_HUB_TASKS; i++ )
+	{
+		Out.printf( "switchbot_task_busy_wall_seconds_total{task=\"%s\"} %.3f\n", Tasks[ i ].name, busyTime[ i ] / 1000000.0 );
+	}
+
+	Out.print( "# HELP switchbot_task_wakeups_total Times each hub task woke with work\n# TYPE switchbot_task_wakeups_total counter\n" );
+	for ( int i = 0; i < NUM_HUB_TASKS; i++ )
+	{
+		Out.printf( "switchbot_task_wakeups_total{task=\"%s\"} %u\n", Tasks[ i ].name, Tasks[ i ].wakeups );
+	}
+
+	Out.print( "# HELP switchbot_task_stack_free_bytes Least free stack each hub task has had\n# TYPE switchbot_task_stack_free_bytes gauge\n" );
+	for ( int i = 0; i < NUM_HUB_TASKS; i++ )
+	{
+		if ( Tasks[ i ].handle != nullptr )
+		{
+			Out.printf( "switchbot_task_stack_free_bytes{task=\"%s\"} %u\n", Tasks[ i ].name, uxTaskGetStackHighWaterMark( Tasks[ i ].handle ) );
+		}
+	}
+}
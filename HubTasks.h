@@ -0,0 +1,118 @@
+/*
+	<SwitchBotBLEHub:- Turn a ESP32 Arduio compatible board into a hub>
+	Copyright (C) <2020>  <Adrian Rockall>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARDUINO_HUB_TASKS_H
+#define ARDUINO_HUB_TASKS_H
+
+#include <Arduino.h>
+#include <stdint.h>
+
+// Core and priority of each task, set at build time to suit the site. A site with many sensors can give ingest a
+// core of its own, one that mostly sends commands can raise the command priority above ingest.
+#ifndef INGEST_TASK_CORE
+#define INGEST_TASK_CORE 1
+#endif
+#ifndef INGEST_TASK_PRIORITY
+#define INGEST_TASK_PRIORITY 3
+#endif
+
+#ifndef COMMAND_TASK_CORE
+#define COMMAND_TASK_CORE 0	   // With the NimBLE host so connection events are handled quickly
+#endif
+#ifndef COMMAND_TASK_PRIORITY
+#define COMMAND_TASK_PRIORITY 2
+#endif
+
+#ifndef CALLBACK_TASK_CORE
+#define CALLBACK_TASK_CORE 1
+#endif
+#ifndef CALLBACK_TASK_PRIORITY
+#define CALLBACK_TASK_PRIORITY 1
+#endif
+
+#ifndef EVENT_TASK_CORE
+#define EVENT_TASK_CORE 1
+#endif
+#ifndef EVENT_TASK_PRIORITY
+#define EVENT_TASK_PRIORITY 2	 // Above the callback task so events go first
+#endif
+
+#ifndef HOUSEKEEPING_TASK_CORE
+#define HOUSEKEEPING_TASK_CORE 1
+#endif
+#ifndef HOUSEKEEPING_TASK_PRIORITY
+#define HOUSEKEEPING_TASK_PRIORITY 1
+#endif
+
+#ifndef FORWARD_TASK_CORE
+#define FORWARD_TASK_CORE 1
+#endif
+#ifndef FORWARD_TASK_PRIORITY
+#define FORWARD_TASK_PRIORITY 1
+#endif
+
+enum HubTaskId
+{
+	TASK_INGEST,		   // Adds adverts from the scan to the device table
+	TASK_COMMAND,		   // Hands queued commands to the command workers
+	TASK_WORKER,		   // The command workers, one per connection, with the same core and priority as TASK_COMMAND
+	TASK_CALLBACK,		   // Sends device changes and failed commands to the callbacks
+	TASK_EVENT,			   // Sends event device changes to the callbacks ahead of the rest
+	TASK_HOUSEKEEPING,	   // Memory checks, discovery broadcasts and reboots
+	TASK_FORWARD,		   // Relays commands for devices only another hub can see
+	NUM_HUB_TASKS
+};
+
+typedef struct HUB_TASK
+{
+	const char* name;
+	uint32_t stackSize;
+	BaseType_t core;
+	UBaseType_t priority;
+	TaskHandle_t handle;
+	uint32_t wakeups;
+	uint64_t busyTime;	  // Microseconds of wall time between Working and Done, including waits for I/O
+};
+
+// The hub's own tasks. Each one sleeps until it has work, times the work and reports how long it was busy for.
+class HubTasks
+{
+  private:
+	HUB_TASK Tasks[ NUM_HUB_TASKS ];
+	portMUX_TYPE Lock;
+
+  public:
+	HubTasks();
+	~HubTasks();
+
+	bool Start( HubTaskId Id, TaskFunction_t Function, void* Param );
+	BaseType_t GetCore( HubTaskId Id );	   // tskNO_AFFINITY on single core chips
+	UBaseType_t GetPriority( HubTaskId Id )
+	{
+		return Tasks[ Id ].priority;
+	};
+	uint32_t GetStackSize( HubTaskId Id )
+	{
+		return Tasks[ Id ].stackSize;
+	};
+	int64_t Working( HubTaskId Id );					 // Call on waking with work, returns the start time for Done
+	void Done( HubTaskId Id, int64_t Start );			 // Adds the wall time since Start to the task's busy time
+	void Write( Print& Out );							 // Prometheus text format
+};
+
+#endif
@@ -27,15 +27,44 @@
 #include <ESPAsyncHTTPUpdateServer.h>
 
 #include "BLE_Device.h"
+#include "HubLog.h"
+#include "HubMemory.h"
+#include "HubBuffers.h"
+#include "HubJournal.h"
+#include "HubMetrics.h"
+#include "HubPeers.h"
+#include "HubScan.h"
+#include "HubTasks.h"
+#include <esp_heap_caps.h>
 #include <esp_task_wdt.h>
+#include <freertos/event_groups.h>
 
-const char* version = "Hello! SwitchBot BLE Hub V2.7";
+// The only copy of the version, the greeting, the home page and the discovery reply are built from it
+#define HUB_VERSION "2.7"
 
-const char HTML[] PROGMEM = "<!DOCTYPE html>\n<html>\n  <head>\n    <meta http-equiv=\"content-type\" content=\"text/html; charset=UTF-8\">\n    <title>Home</title>\n  </head>\n  <body>\n    <h1><b>Welcome to the ESP32 SwitchBot BLE hub for Homey.</b></h1>\n    <p><i>Version 2.7</i></p>\n    <p><a href=\"/update\">Update the firmware</a></p>\n    <p><a href=\"/api/v1/devices\">View the registered devices</a></p>\n  </body>\n</html>\n";
+const char* version = "Hello! SwitchBot BLE Hub V" HUB_VERSION;
+const char* firmwareVersion = HUB_VERSION;
+
+// Discovery requests on the multicast group. Version 1 gets the next broadcast brought forward, version 2 gets an
+// immediate reply to the sender with the hub's load.
+#define DISCOVERY_QUERY	   "Are you there SwitchBot?"
+#define DISCOVERY_QUERY_V2 "Are you there SwitchBot? v2"
+#define DISCOVERY_SIZE	   600	  // Largest discovery or peer report packet
+
+const char HTML[] PROGMEM = "<!DOCTYPE html>\n<html>\n  <head>\n    <meta http-equiv=\"content-type\" content=\"text/html; charset=UTF-8\">\n    <title>Home</title>\n  </head>\n  <body>\n    <h1><b>Welcome to the ESP32 SwitchBot BLE hub for Homey.</b></h1>\n    <p><i>Version " HUB_VERSION "</i></p>\n    <p><a href=\"/update\">Update the firmware</a></p>\n    <p><a href=\"/api/v1/devices\">View the registered devices</a></p>\n  </body>\n</html>\n";
 BLE_Device BLE_Devices;
 ClientCallbacks OurCallbacks;
 
 CommandQ BLECommandQ;
+GattCache GattHandles;
+CommandStats CommandStatistics;
+HubMetrics Metrics;
+BufferPool Buffers;
+MemoryGuard Memory;
+HubTasks Tasks;
+EventJournal Journal;
+ScanScheduler ScanSchedule;
+DeviceOwnership Ownership;
 AsyncWebServer server( 80 );
 DNSServer dns;
 AsyncUDP udp;
@@ -48,11 +77,10 @@ const int led = 14;
 
 char macAddress[ 18 ];
 unsigned long sendBroadcast = 0;
-uint8_t BLENotifyData[ 50 ];
-int BLENotifyLength = 0;
-uint32_t BLESending = 0;
+unsigned long sendPeerReport = 0;
 bool RebootRequired = false;
 int32_t NumUpdates = 0;
+uint32_t BootId;	// Part of the device table ETag so a tag from before a reboot never matches
 
 // The remote service we wish to connect to.
 static BLEUUID serviceUUID( "cba20d00-224d-11e6-9fb8-0002a5d5c51b" );
@@ -61,6 +89,200 @@ static BLEUUID charUUID( "cba20002-224d-11e6-9fb8-0002a5d5c51b" );
 // The characteristic of the notification service we are interested in.
 static BLEUUID notifyUUID( "cba20003-224d-11e6-9fb8-0002a5d5c51b" );
 
+// Commands that haven't been sent within this time (ms) are dropped, unless the request specifies a timeout
+const unsigned long defaultCommandTimeout = 30000;
+
+// How often the largest free heap block is checked (ms) and how long device changes are batched for when memory is short
+const unsigned long memoryCheckInterval = 250;
+const unsigned long callbackBatchTime	= 5000;
+
+// Scan passively except for short active bursts to discover devices and to get scan responses for the models that
+// need them. Off by default because which part of the advert is in the scan response varies with the firmware.
+const bool selectiveActiveScan = false;
+
+// Keep the device table in NVS so the devices are known straight after a reboot
+const bool persistDevices = true;
+
+// Share the RSSI of each device with the other hubs and only send the changes of the devices this hub has the best
+// signal for to the callbacks
+const bool electDeviceOwners = true;
+
+// How often part of the RSSI report is multicast (ms), less often while there are no other hubs
+const unsigned long peerReportInterval	   = 5000;
+const unsigned long peerIdleReportInterval = 30000;
+
+// How long the ingest task waits for an advert before checking whether the device table needs saving (ms)
+const unsigned long ingestIdleInterval = 1000;
+
+// Keep the GATT handles in NVS so they survive a reboot
+const bool persistGattHandles = true;
+static struct ble_gap_event_listener gapEventListener;
+
+// Number of commands that can be sent to different devices at the same time.
+// Must not exceed CONFIG_BT_NIMBLE_MAX_CONNECTIONS.
+#define MAX_BLE_CONNECTIONS 3
+
+// Command states, see WriteToBLEDevice
+enum COMMAND_STATE
+{
+	CMD_IDLE,
+	CMD_CONNECTING,
+	CMD_DISCOVERING,
+	CMD_SUBSCRIBING,
+	CMD_WRITING,
+	CMD_CACHE_FAILED,
+	CMD_AWAIT_NOTIFY,
+	CMD_REPLYING,
+	CMD_DISCONNECTING,
+	CMD_DONE
+};
+
+// Events from the NimBLE host that move a command to the next state
+#define CMD_EVT_START		   ( 1 << 0 )
+#define CMD_EVT_CONNECTED	   ( 1 << 1 )
+#define CMD_EVT_CONNECT_FAILED ( 1 << 2 )
+#define CMD_EVT_DISCONNECTED   ( 1 << 3 )
+#define CMD_EVT_CCCD_WRITTEN   ( 1 << 4 )
+#define CMD_EVT_NOTIFY		   ( 1 << 5 )
+#define CMD_EVT_WRITTEN		   ( 1 << 6 )
+#define CMD_EVT_ALL			   ( CMD_EVT_CONNECTED | CMD_EVT_CONNECT_FAILED | CMD_EVT_DISCONNECTED | CMD_EVT_CCCD_WRITTEN | CMD_EVT_NOTIFY | CMD_EVT_WRITTEN )
+
+// Each slot has a worker task that executes one command at a time
+typedef struct COMMAND_SLOT
+{
+	TaskHandle_t task;
+	EventGroupHandle_t events;
+	BLE_COMMAND command;
+	volatile bool busy;
+	volatile COMMAND_STATE state;
+	unsigned long readyTime;
+	NimBLEClient* client;
+	char model;
+	GATT_HANDLES handles;
+	unsigned long times[ NUM_TIMES ];	 // When the command reached each stage
+	uint8_t retries;
+	uint8_t notifyData[ 50 ];			 // Response for this command
+	volatile int notifyLength;
+	uint16_t notifyConnHandle;
+	uint16_t notifyAttrHandle;
+	volatile int cccdStatus;
+	volatile int writeStatus;
+};
+
+COMMAND_SLOT CommandSlots[ MAX_BLE_CONNECTIONS ];
+
+// Only one connection can be established at a time, the rest of the command runs in parallel
+SemaphoreHandle_t ConnectMutex;
+
+// Events that wake the command and callback tasks, they also wake for their timers
+#define HUB_EVT_DEVICE_CHANGED ( 1 << 0 )	 // A device was added or changed
+#define HUB_EVT_COMMAND		   ( 1 << 1 )	 // A command was queued or a worker became free
+#define HUB_EVT_EVENT_CHANGED  ( 1 << 2 )	 // An event device (contact, motion, remote, leak) changed
+#define HUB_EVT_BLE_READY	   ( 1 << 3 )	 // StartBLETask has started the scan
+#define HUB_EVT_FORWARD		   ( 1 << 4 )	 // A write is waiting to be forwarded to another hub
+#define HUB_EVT_COMMAND_FAILED ( 1 << 5 )	 // A failed command is waiting to be reported to its callback
+
+EventGroupHandle_t HubEvents;
+
+// Event devices in one callback, so each one's events fit
+#define EVENTS_PER_CALLBACK 3
+
+// Adverts are copied off the NimBLE host task and added to the device table by the ingest task
+#define ADVERT_QUEUE_LENGTH 32
+#define ADVERT_DATA_SIZE	31	  // Most a legacy advert can carry
+typedef struct ADVERT
+{
+	char MAC[ 18 ];
+	uint8_t addrType;
+	int rssi;
+	uint8_t serviceData[ ADVERT_DATA_SIZE ];
+	uint8_t serviceDataLen;
+	uint8_t manufacturerData[ ADVERT_DATA_SIZE ];
+	uint8_t manufacturerDataLen;
+};
+
+QueueHandle_t AdvertQueue;
+uint32_t AdvertsDropped = 0;	// Queue was full, the device will advertise again
+
+// Commands that failed with no request waiting for them. The POST to the callback can take seconds, so the callback
+// task sends it instead of the command task.
+#define FAILED_QUEUE_LENGTH 8
+typedef struct FAILED_COMMAND
+{
+	BLE_COMMAND command;
+	const char* reason;	   // Always a string literal
+};
+
+QueueHandle_t FailedQueue;
+
+// How long the command and callback tasks sleep for when nothing wakes them (ms)
+const unsigned long commandCheckInterval  = 1000;
+const unsigned long callbackCheckInterval = 250;
+const unsigned long eventRetryInterval	  = 2000;	 // After no callback accepted an event
+
+// Write requests that asked to wait for the result. The HTTP request is paused until the command completes and the
+// reply goes back on the same connection instead of to a callback.
+#define MAX_REPLY_WAITERS 4
+typedef struct REPLY_WAITER
+{
+	AsyncWebServerRequestPtr request;
+	uint32_t seq;				// Queue sequence number of the command
+	unsigned long deadline;		// Give up with a 504 after this
+	bool active;
+};
+
+REPLY_WAITER ReplyWaiters[ MAX_REPLY_WAITERS ];
+SemaphoreHandle_t WaitersMutex;
+
+// Extra time allowed for a waited command to connect and reply after it leaves the queue
+const unsigned long replyWaitMargin = 30000;
+
+// Writes for devices this hub hasn't seen go to the peer hub with the best signal from the device. The request is
+// paused until the forward task has the peer's reply. Requests carrying the forwarded header are never forwarded
+// again so two hubs can't pass a command back and forth. The client's address goes with the write so the peer sends
+// any reply to the client's callback.
+#define MAX_FORWARDS	  2
+#define FORWARD_BODY_SIZE 512
+#define FORWARDED_HEADER  "X-SwitchBot-Forwarded"
+#define REPLY_TO_HEADER	  "X-SwitchBot-Reply-To"	// Only honoured with FORWARDED_HEADER from a peer hub
+typedef struct FORWARD
+{
+	AsyncWebServerRequestPtr request;
+	uint32_t ip;
+	char peerMAC[ 18 ];
+	char replyTo[ 16 ];
+	bool wait;	  // Pass on ?wait so the peer holds its reply too
+	size_t length;
+	char body[ FORWARD_BODY_SIZE ];
+	bool active;
+};
+
+FORWARD Forwards[ MAX_FORWARDS ];
+SemaphoreHandle_t ForwardsMutex;
+uint32_t ForwardsSent	= 0;
+uint32_t ForwardsFailed = 0;
+
+// How long to wait for the peer's reply (ms), a waited command can take its full timeout plus the wait margin
+const uint16_t forwardTimeout	  = 5000;
+const uint16_t forwardWaitTimeout = 60000;
+
+// Request bodies can arrive in several chunks, they are put back together in one of these before being parsed.
+// Only used by the web server task.
+#define BODY_BUFFERS	 4
+#define BODY_BUFFER_SIZE 2048
+typedef struct BODY_BUFFER
+{
+	AsyncWebServerRequest* request;	   // Owner, nullptr when free
+	unsigned long claimed;
+	size_t length;
+	char data[ BODY_BUFFER_SIZE + 1 ];
+};
+
+BODY_BUFFER BodyBuffers[ BODY_BUFFERS ];
+
+// A buffer for a body that stops arriving can be reused after this (ms)
+const unsigned long bodyBufferTimeout = 10000;
+
 void handleRoot( AsyncWebServerRequest* request )
 {
 	digitalWrite( led, 1 );
@@ -87,24 +309,34 @@ void handleNotFound( AsyncWebServerRequest* request )
 	digitalWrite( led, 0 );
 }
 
-void notifyCallback(
-	BLERemoteCharacteristic* pBLERemoteCharacteristic,
-	uint8_t* pData,
-	size_t length,
-	bool isNotify )
+// The notifications are taken straight from the GAP events so they work with cached handles (no discovered characteristic)
+static int onGapEvent( struct ble_gap_event* event, void* arg )
 {
-	// Serial.print( "Notify callback for characteristic " );
-	// Serial.print( pBLERemoteCharacteristic->getUUID().toString().c_str() );
-	// Serial.print( " of data length " );
-	// Serial.println( (unsigned long)length );
+	if ( event->type != BLE_GAP_EVENT_NOTIFY_RX )
+	{
+		return 0;
+	}
 
-	if ( length > 50 )
+	for ( uint8_t i = 0; i < MAX_BLE_CONNECTIONS; i++ )
 	{
-		length = 50;
+		COMMAND_SLOT* slot = &CommandSlots[ i ];
+		if ( slot->busy && ( slot->notifyAttrHandle != 0 ) &&
+			 ( event->notify_rx.conn_handle == slot->notifyConnHandle ) && ( event->notify_rx.attr_handle == slot->notifyAttrHandle ) )
+		{
+			int length = OS_MBUF_PKTLEN( event->notify_rx.om );
+			if ( length > 50 )
+			{
+				length = 50;
+			}
+
+			os_mbuf_copydata( event->notify_rx.om, 0, length, slot->notifyData );
+			slot->notifyLength = length;
+			xEventGroupSetBits( slot->events, CMD_EVT_NOTIFY );
+			break;
+		}
 	}
 
-	memcpy( BLENotifyData, pData, length );
-	BLENotifyLength = length;
+	return 0;
 }
 
 static constexpr uint32_t scanTime = 30 * 1000; // 30 seconds scan time.
@@ -123,23 +355,37 @@ class MyAdvertisedDeviceCallbacks : public BLEAdvertisedDeviceCallbacks
 		NimBLEUUID id1( ( uint16_t ) 0x0d00 );
 		NimBLEUUID id2( ( uint16_t ) 0xfd3d );
 		NimBLEUUID devicId = advertisedDevice->getServiceDataUUID();
+		Metrics.Advert();
 		if ( ( devicId == id1 ) || ( devicId == id2 ) )
 		{
-			if ( BLE_Devices.AddDevice( advertisedDevice->getAddress().toString().c_str(), advertisedDevice->getRSSI(), ( uint8_t* ) advertisedDevice->getServiceData().data(), advertisedDevice->getServiceData().length(), ( uint8_t* ) advertisedDevice->getManufacturerData().data(), advertisedDevice->getManufacturerData().length() ) )
+			std::string serviceData		 = advertisedDevice->getServiceData();
+			std::string manufacturerData = advertisedDevice->getManufacturerData();
+			if ( ( serviceData.length() > ADVERT_DATA_SIZE ) || ( manufacturerData.length() > ADVERT_DATA_SIZE ) )
+			{
+				Metrics.SwitchBotAdvert( serviceData.length() ? serviceData[ 0 ] : 0, ADVERT_INVALID );
+				return;
+			}
+
+			// The device table is only changed by the ingest task
+			ADVERT advert;
+			strlcpy( advert.MAC, advertisedDevice->getAddress().toString().c_str(), sizeof( advert.MAC ) );
+			advert.addrType			   = advertisedDevice->getAddress().getType();
+			advert.rssi				   = advertisedDevice->getRSSI();
+			advert.serviceDataLen	   = serviceData.length();
+			advert.manufacturerDataLen = manufacturerData.length();
+			memcpy( advert.serviceData, serviceData.data(), advert.serviceDataLen );
+			memcpy( advert.manufacturerData, manufacturerData.data(), advert.manufacturerDataLen );
+
+			if ( xQueueSend( AdvertQueue, &advert, 0 ) != pdTRUE )
 			{
-				// Serial.printf( "Updated device: %s\n", advertisedDevice->getAddress().toString().c_str() );
-        NumUpdates++;
+				__atomic_fetch_add( &AdvertsDropped, 1, __ATOMIC_RELAXED );
 			}
-			// else
-			// {
-			// 	Serial.printf( "Ignored device: %s\n", advertisedDevice->getAddress().toString().c_str() );
-			// }
 		}
 	};	  // onResult
 
   void onScanEnd(const NimBLEScanResults& results, int reason) override
   {
-        Serial.printf("Scan ended reason = %d; restarting scan\n", reason);
+        LOG_INFO( "Scan ended reason = %d; restarting scan", reason);
         NimBLEDevice::getScan()->start(scanTime, false, true);
     }
 };		  // MyAdvertisedDeviceCallbacks
@@ -149,28 +395,45 @@ void setup()
 	pinMode( led, OUTPUT );
 	digitalWrite( led, 0 );
 	Serial.begin( 921600 );
-	Serial.println( "Starting Arduino BLE Client application..." );
+	HubLog.Begin( 1 );
+	LOG_INFO( "Starting Arduino BLE Client application..." );
+
+	// Reserve the reply buffers before anything else can fragment the heap
+	if ( !Buffers.Begin() )
+	{
+		LOG_ERROR( "Failed to reserve the buffer pool" );
+	}
+
+	// Known devices are usable before they advertise again
+	BLE_Devices.Begin( persistDevices );
+
+	BootId		 = esp_random();
+	HubEvents	 = xEventGroupCreate();
+	AdvertQueue	 = xQueueCreate( ADVERT_QUEUE_LENGTH, sizeof( ADVERT ) );
+	FailedQueue	 = xQueueCreate( FAILED_QUEUE_LENGTH, sizeof( FAILED_COMMAND ) );
+	WaitersMutex  = xSemaphoreCreateMutex();
+	ForwardsMutex = xSemaphoreCreateMutex();
+
+	// Scan while Wi-Fi connects, which can take minutes if the portal is needed
+	Tasks.Start( TASK_INGEST, IngestTask, nullptr );
+	xTaskCreatePinnedToCore( StartBLETask, "BLEStart", 6144, nullptr, Tasks.GetPriority( TASK_INGEST ), nullptr, Tasks.GetCore( TASK_INGEST ) );
 
 	AsyncWiFiManager wifiManager( &server, &dns );
 	//    wifiManager.resetSettings();
 	wifiManager.autoConnect( "SwitchBot_ESP32" );
 
-	Serial.println( "" );
-	Serial.print( "Connected to " );
-	Serial.print( "IP address: " );
-	Serial.println( WiFi.localIP() );
-
-	// BLEDevice::init( "" );
+	LOG_INFO( "Connected, IP address: %s", WiFi.localIP().toString().c_str() );
+	Metrics.BootPhaseReached( BOOT_WIFI_CONNECTED );
 
 	server.on( "/", handleRoot );
 
 	sendBroadcast = millis();
   server.onNotFound([](AsyncWebServerRequest* request) {
-    if ((request->url() == "/api/v1/callback/add") || (request->url() == "/api/v1/callback/remove") || (request->url() == "/api/v1/device/write"))
+    if ((request->url() == "/api/v1/callback/add") || (request->url() == "/api/v1/callback/remove") || (request->url() == "/api/v1/device/write") || (request->url() == "/api/v1/device/write/batch"))
       return; // response object already created by onRequestBody
 
     String url = request->url();
-    Serial.printf( "Callback %s not found\n", url.c_str() );
+    LOG_WARN( "Callback %s not found", url.c_str() );
 
     request->send(404, "text/plain", "Not found");
   });
@@ -180,15 +443,26 @@ void setup()
 		{
 			if ( request->method() == HTTP_POST )
 			{
+				BODY_BUFFER* body = CollectBody( request, data, len, index, total );
+				if ( body == nullptr )
+				{
+					return;	   // Wait for the rest of the body
+				}
+
 				digitalWrite( led, 1 );
 
-				if ( request->url() == "/api/v1/callback/add" )
+				// Short of memory so refuse new commands, the client can retry
+				if ( ( Memory.GetStage() >= MEM_LOW ) && ( ( request->url() == "/api/v1/device/write" ) || ( request->url() == "/api/v1/device/write/batch" ) ) )
 				{
-          Serial.println( "Received request for callback add" );
-					const size_t JSON_DOC_SIZE = 512U;
-					DynamicJsonDocument jsonDoc( JSON_DOC_SIZE );
+					Memory.CountShed();
+					request->send( 503, "text/plain", "Service Unavailable" );
+				}
+				else if ( request->url() == "/api/v1/callback/add" )
+				{
+          LOG_INFO( "Received request for callback add" );
+					StaticJsonDocument< 512 > jsonDoc;
 
-					if ( DeserializationError::Ok == deserializeJson( jsonDoc, ( const char* ) data ) )
+					if ( DeserializationError::Ok == deserializeJson( jsonDoc, body->data, body->length ) )
 					{
 						JsonObject callbackAddress = jsonDoc.as< JsonObject >();
 						if ( OurCallbacks.Add( callbackAddress[ "uri" ], millis() ) )
@@ -198,29 +472,28 @@ void setup()
 
 							String msg = "OK"; //Buf;
 							request->send( 200, "text/plain", msg );
-              Serial.println( "Callback added" );
+              LOG_INFO( "Callback added" );
 						}
 						else
 						{
 							String msg = "Too Many Requests";
 							request->send( 429, "text/plain", msg );
-              Serial.println( "Callback error 429" );
+              LOG_ERROR( "Callback error 429" );
 						}
 					}
 					else
 					{
 						String msg = "Bad Request";
 						request->send( 400, "text/plain", msg );
-            Serial.println( "Callback error 400" );
+            LOG_ERROR( "Callback error 400" );
 					}
 				}
 				else if ( request->url() == "/api/v1/callback/remove" )
 				{
-          Serial.println( "Received request for callback remove" );
-					const size_t JSON_DOC_SIZE = 512U;
-					DynamicJsonDocument jsonDoc( JSON_DOC_SIZE );
+          LOG_INFO( "Received request for callback remove" );
+					StaticJsonDocument< 512 > jsonDoc;
 
-					if ( DeserializationError::Ok == deserializeJson( jsonDoc, ( const char* ) data ) )
+					if ( DeserializationError::Ok == deserializeJson( jsonDoc, body->data, body->length ) )
 					{
 						JsonObject callbackAddress = jsonDoc.as< JsonObject >();
 						if ( OurCallbacks.Remove( ( const char* ) callbackAddress[ "uri" ] ) )
@@ -240,29 +513,52 @@ void setup()
 				}
 				else if ( request->url() == "/api/v1/device/write" )
 				{
-					const size_t JSON_DOC_SIZE = 512U;
-					DynamicJsonDocument jsonDoc( JSON_DOC_SIZE );
+					StaticJsonDocument< 512 > jsonDoc;
 
-					if ( DeserializationError::Ok == deserializeJson( jsonDoc, ( const char* ) data ) )
+					if ( DeserializationError::Ok == deserializeJson( jsonDoc, body->data, body->length ) )
 					{
 						JsonObject writeParameters = jsonDoc.as< JsonObject >();
-						String clientAddress	   = writeParameters[ "address" ];
+						const char* clientAddress  = writeParameters[ "address" ];
 
 						// Check that we have seen that device
-						int deviceIdx = BLE_Devices.FindDevice( clientAddress.c_str() );
-						if ( deviceIdx >= 0 )
+						int deviceIdx = ( clientAddress != nullptr ) ? BLE_Devices.FindDevice( clientAddress ) : -1;
+						BLE_COMMAND command;
+						char sourceIP[ 16 ];
+						GetRemoteIP( request, sourceIP, sizeof( sourceIP ) );
+
+						// Hold the response until the command completes
+						bool wait = writeParameters[ "wait" ] | request->hasParam( "wait" );
+
+						if ( ( deviceIdx < 0 ) && ( clientAddress != nullptr ) && ForwardCommand( request, clientAddress, sourceIP, wait, body->data, body->length ) )
 						{
-							String dataToWrite = writeParameters[ "data" ];
-							String sourcIP	   = request->client()->remoteIP().toString();
-							Serial.printf( "Received request to write device %s with %s (%i) from %s\n", clientAddress.c_str(), dataToWrite.c_str(), dataToWrite.length(), sourcIP.c_str() );
+							LOG_INFO( "Forwarding the write for %s", clientAddress );
+						}
+						else if ( deviceIdx < 0 )
+						{
+							request->send( 422, "text/plain", "Unknown device" );
+							LOG_WARN( "Received request to write device %s but I have not seen that device)", clientAddress ? clientAddress : "" );
+						}
+						else if ( !BuildCommand( writeParameters, sourceIP, &command ) )
+						{
+							request->send( 400, "text/plain", "Bad Request" );
+						}
+						else
+						{
+							LOG_INFO( "Received request to write device %s with %i bytes from %s", command.Address, command.DataLen, sourceIP );
 
-							if (BLECommandQ.Find( clientAddress, dataToWrite ))
-              {
-                // Same command already queued
+							bool waiting		  = false;
+							CommandQResult result = QueueCommand( request, &command, wait, &waiting );
+							if ( waiting )
+							{
+								LOG_INFO( "Waiting for the command to complete" );
+							}
+							else if ( result == CMDQ_REPLACED )
+							{
+								// Same type of command already queued so that now sends the new data
 								request->send( 200, "text/plain", "OK" );
-								Serial.println( "Command already in the Q" );
-              }
-              else if ( BLECommandQ.Push( clientAddress, dataToWrite, sourcIP ) )
+								LOG_INFO( "Replaced the command in the Q" );
+							}
+							else if ( result == CMDQ_QUEUED )
 							{
 								request->send( 200, "text/plain", "OK" );
 							}
@@ -270,15 +566,9 @@ void setup()
 							{
 								String msg = "Too Many Requests";
 								request->send( 429, "text/plain", msg );
-								Serial.println( "I have too much in my command Q" );
+								LOG_WARN( "I have too much in my command Q" );
 							}
 						}
-						else
-						{
-							String msg = "Unknown device";
-							request->send( 422, "text/plain", msg );
-							Serial.printf( "Received request to write device %s but I have not seen that device)\n", clientAddress.c_str() );
-						}
 					}
 					else
 					{
@@ -286,7 +576,12 @@ void setup()
 						request->send( 400, "text/plain", msg );
 					}
 				}
+				else if ( request->url() == "/api/v1/device/write/batch" )
+				{
+					HandleBatchWrite( request, body->data, body->length );
+				}
 
+				ReleaseBody( body );
 				digitalWrite( led, 0 );
 			}
 		} );
@@ -295,20 +590,262 @@ void setup()
 			   {
             digitalWrite( led, 1 );
 
-            Serial.println( "Received request for devices" );
-            char* buf = ( char* ) malloc( 4096 );
+            LOG_INFO( "Received request for devices" );
+            if ( Memory.GetStage() >= MEM_CRITICAL )
+            {
+              Memory.CountShed();
+              request->send( 503, "text/plain", "Service Unavailable" );
+              digitalWrite( led, 0 );
+              return;
+            }
+
+            // The ETag is the change sequence so a poller that is up to date gets a 304 with no body
+            uint32_t changeSeq = BLE_Devices.GetChangeSeq();
+            char etag[ 24 ];
+            snprintf( etag, sizeof( etag ), "\"%08x-%u\"", BootId, changeSeq );
+
+            const AsyncWebHeader* ifNoneMatch = request->getHeader( "If-None-Match" );
+            if ( ifNoneMatch && ( strstr( ifNoneMatch->value().c_str(), etag ) != nullptr ) )
+            {
+              AsyncWebServerResponse* response = request->beginResponse( 304 );
+              response->addHeader( "ETag", etag );
+              request->send( response );
+              digitalWrite( led, 0 );
+              return;
+            }
+
+            // Optional filters, since returns only the devices that changed after that sequence number. The sequence
+            // starts again at each boot, so a since from another boot (boot= isn't ours, or since is ahead of us) gets
+            // every device.
+            uint32_t since = 0;
+            char model = 0;
+            const char* mac = nullptr;
+            if ( request->hasParam( "since" ) )
+            {
+              since = strtoul( request->getParam( "since" )->value().c_str(), nullptr, 10 );
+            }
+            if ( ( request->hasParam( "boot" ) && ( strtoul( request->getParam( "boot" )->value().c_str(), nullptr, 16 ) != BootId ) ) ||
+                 ( since > changeSeq ) )
+            {
+              since = 0;
+            }
+            if ( request->hasParam( "model" ) )
+            {
+              model = request->getParam( "model" )->value().c_str()[ 0 ];
+            }
+            if ( request->hasParam( "mac" ) )
+            {
+              mac = request->getParam( "mac" )->value().c_str();
+            }
+
+            char* buf = Buffers.Borrow( 4096 );
+            if (buf)
+            {
+              char seqStr[ 12 ];
+              char bootStr[ 12 ];
+              snprintf( seqStr, sizeof( seqStr ), "%u", changeSeq );
+              snprintf( bootStr, sizeof( bootStr ), "%08x", BootId );
+
+              // A list that was cut short has no ETag or sequence, so a poller doesn't skip the devices it didn't get
+              bool complete = BLE_Devices.FilteredToJson( buf, 4096, since, model, mac, macAddress ) >= 0;
+              LOG_DEBUG( "%s", buf );
+              AsyncWebServerResponse* response = request->beginResponse( 200, "application/json", buf );
+              response->addHeader( "X-Boot-Id", bootStr );
+              if ( complete )
+              {
+                response->addHeader( "ETag", etag );
+                response->addHeader( "X-Change-Seq", seqStr );
+              }
+              else
+              {
+                LOG_WARN( "Not all the devices fit, use the model or mac filters" );
+              }
+              request->send( response );
+              Buffers.Return( buf );
+            }
+            else
+            {
+              LOG_ERROR( "Failed to allocate buf for JSON" );
+              request->send( 503, "text/plain", "Service Unavailable" );
+            }
+            digitalWrite( led, 0 );
+          } );
+
+	server.on( "/api/v1/stats/commands", HTTP_GET, []( AsyncWebServerRequest* request )
+			   {
+            if ( Memory.GetStage() >= MEM_CRITICAL )
+            {
+              Memory.CountShed();
+              request->send( 503, "text/plain", "Service Unavailable" );
+              return;
+            }
+
+            digitalWrite( led, 1 );
+
+            char* buf = Buffers.Borrow( 6144 );
             if (buf)
             {
-              BLE_Devices.AllToJson( buf, 4096, false, macAddress );
-              Serial.println( buf );
+              if ( CommandStatistics.ToJson( buf, 6144, BLE_Devices, macAddress ) > 0 )
+              {
+                request->send( 200, "application/json", buf );
+              }
+              else
+              {
+                request->send( 500, "text/plain", "Statistics too large" );
+              }
+              Buffers.Return( buf );
+            }
+            else
+            {
+              LOG_ERROR( "Failed to allocate buf for JSON" );
+              request->send( 503, "text/plain", "Service Unavailable" );
+            }
+            digitalWrite( led, 0 );
+          } );
+
+	server.on( "/metrics", HTTP_GET, []( AsyncWebServerRequest* request )
+			   {
+            if ( Memory.GetStage() >= MEM_CRITICAL )
+            {
+              Memory.CountShed();
+              request->send( 503, "text/plain", "Service Unavailable" );
+              return;
+            }
+
+            digitalWrite( led, 1 );
+
+            AsyncResponseStream* response = request->beginResponseStream( "text/plain; version=0.0.4" );
+            Metrics.Write( *response );
+            WriteGauge( *response, "switchbot_devices", "Devices in the device table", BLE_Devices.GetNumberOfDevices() );
+            WriteCounter( *response, "switchbot_device_table_saves_total", "Times the device table was saved to NVS", BLE_Devices.GetNumberOfSaves() );
+            WriteGauge( *response, "switchbot_command_queue_depth", "Commands waiting to be sent", BLECommandQ.GetNumberQueued() );
+            WriteCounter( *response, "switchbot_command_queue_rejected_total", "Commands refused because the queue was full", BLECommandQ.GetNumberRejected() );
+            WriteGauge( *response, "switchbot_heap_free_bytes", "Free heap", esp_get_free_heap_size() );
+            WriteGauge( *response, "switchbot_heap_largest_free_block_bytes", "Largest block that can be allocated", heap_caps_get_largest_free_block( MALLOC_CAP_8BIT ) );
+            WriteGauge( *response, "switchbot_uptime_seconds", "Time since boot", millis() / 1000 );
+            WriteGauge( *response, "switchbot_advert_queue_depth", "Adverts waiting for the ingest task", uxQueueMessagesWaiting( AdvertQueue ) );
+            WriteCounter( *response, "switchbot_adverts_dropped_total", "Adverts dropped because the ingest queue was full", AdvertsDropped );
+            Buffers.Write( *response );
+            Memory.Write( *response );
+            Tasks.Write( *response );
+            Journal.Write( *response );
+            ScanSchedule.Write( *response );
+            Ownership.Write( *response );
+            WriteCounter( *response, "switchbot_forwards_total", "Writes forwarded to another hub", ForwardsSent );
+            WriteCounter( *response, "switchbot_forward_failures_total", "Forwarded writes the peer didn't answer", ForwardsFailed );
+            request->send( response );
+            digitalWrite( led, 0 );
+          } );
+
+	server.on( "/api/v1/peers", HTTP_GET, []( AsyncWebServerRequest* request )
+			   {
+            if ( Memory.GetStage() >= MEM_CRITICAL )
+            {
+              Memory.CountShed();
+              request->send( 503, "text/plain", "Service Unavailable" );
+              return;
+            }
+
+            digitalWrite( led, 1 );
+
+            // The other hubs and the devices this hub reports
+            char* buf = Buffers.Borrow( 2048 );
+            if ( buf == nullptr )
+            {
+              request->send( 503, "text/plain", "Service Unavailable" );
+              digitalWrite( led, 0 );
+              return;
+            }
+
+            if ( Ownership.PeersToJson( buf, 2048, millis() ) > 0 )
+            {
               request->send( 200, "application/json", buf );
-              free( buf );
             }
             else
             {
-              Serial.println( "Failed to allocate buf for JSON");
-              RebootRequired = true;
+              request->send( 503, "text/plain", "Service Unavailable" );
+            }
+            Buffers.Return( buf );
+            digitalWrite( led, 0 );
+          } );
+
+	server.on( "/api/v1/events", HTTP_GET, []( AsyncWebServerRequest* request )
+			   {
+            if ( Memory.GetStage() >= MEM_CRITICAL )
+            {
+              Memory.CountShed();
+              request->send( 503, "text/plain", "Service Unavailable" );
+              return;
+            }
+
+            digitalWrite( led, 1 );
+
+            // Event device transitions in order, ?since= returns the ones after that sequence number
+            uint32_t since = 0;
+            if ( request->hasParam( "since" ) )
+            {
+              since = strtoul( request->getParam( "since" )->value().c_str(), nullptr, 10 );
+            }
+
+            char* buf = Buffers.Borrow( 4096 );
+            if ( buf == nullptr )
+            {
+              request->send( 503, "text/plain", "Service Unavailable" );
+              digitalWrite( led, 0 );
+              return;
+            }
+
+            uint32_t next;
+            Journal.ToJson( buf, 4096, since, macAddress, BootId, &next );
+
+            // A different boot id means the sequence has started again, so since should go back to 0
+            char nextStr[ 12 ];
+            char bootStr[ 12 ];
+            snprintf( nextStr, sizeof( nextStr ), "%u", next );
+            snprintf( bootStr, sizeof( bootStr ), "%08x", BootId );
+            AsyncWebServerResponse* response = request->beginResponse( 200, "application/json", buf );
+            response->addHeader( "X-Event-Next", nextStr );
+            response->addHeader( "X-Boot-Id", bootStr );
+            request->send( response );
+            Buffers.Return( buf );
+            digitalWrite( led, 0 );
+          } );
+
+	server.on( "/api/v1/boot", HTTP_GET, []( AsyncWebServerRequest* request )
+			   {
+            // When each start up phase was reached, in ms after boot
+            char buf[ 256 ];
+            int bytes = snprintf( buf, sizeof( buf ), "{\"hubMAC\":\"%s\",\"bootId\":\"%08x\",\"uptime\":%lu,\"phases\":", macAddress, BootId, millis() );
+            bytes += Metrics.BootToJson( buf + bytes, sizeof( buf ) - bytes - 1 );
+            snprintf( buf + bytes, sizeof( buf ) - bytes, "}" );
+            request->send( 200, "application/json", buf );
+          } );
+
+	server.on( "/api/v1/logs", HTTP_GET, []( AsyncWebServerRequest* request )
+			   {
+            if ( Memory.GetStage() >= MEM_CRITICAL )
+            {
+              Memory.CountShed();
+              request->send( 503, "text/plain", "Service Unavailable" );
+              return;
+            }
+
+            digitalWrite( led, 1 );
+
+            // Recent log lines as "seq time level text", ?since= returns the lines from that sequence number
+            uint32_t since = 0;
+            if ( request->hasParam( "since" ) )
+            {
+              since = strtoul( request->getParam( "since" )->value().c_str(), nullptr, 10 );
             }
+
+            AsyncResponseStream* response = request->beginResponseStream( "text/plain" );
+            uint32_t next = HubLog.Dump( *response, since );
+
+            char nextStr[ 12 ];
+            snprintf( nextStr, sizeof( nextStr ), "%u", next );
+            response->addHeader( "X-Log-Next", nextStr );
+            request->send( response );
             digitalWrite( led, 0 );
           } );
 
@@ -316,22 +853,22 @@ void setup()
 			   {
             digitalWrite( led, 1 );
             String address = request->arg( "address" );
-            Serial.printf( "Received request for device: %s\n", address.c_str() );
+            LOG_INFO( "Received request for device: %s", address.c_str() );
 
             int deviceIdx = BLE_Devices.FindDevice( address.c_str() );
 
-            char* buf = (char*)malloc( 2048 );
+            char* buf = Buffers.Borrow( 2048 );
             if (buf)
             {
               BLE_Devices.DeviceToJson( deviceIdx, buf, 2048, macAddress );
               // Serial.println( buf );
               request->send( 200, "application/json", buf );
-              free( buf );
+              Buffers.Return( buf );
             }
             else
             {
-              Serial.println( "Failed to allocate buf for JSON");
-              RebootRequired = true;
+              LOG_ERROR( "Failed to allocate buf for JSON" );
+              request->send( 503, "text/plain", "Service Unavailable" );
             }
 
             digitalWrite( led, 0 );
@@ -343,386 +880,1610 @@ void setup()
 	_updateServer.setup( &server );
 
 	server.begin();
-	Serial.println( "HTTP server started" );
-
-	BLEDevice::init( "" );
-
-	// Retrieve a Scanner and set the callback we want to use to be informed when we
-	// have detected a new device.  Specify that we want active scanning and start the
-	// scan to run for 5 seconds.
-	BLEScan* pBLEScan = BLEDevice::getScan();
-	pBLEScan->setScanCallbacks( new MyAdvertisedDeviceCallbacks(), true );
-	pBLEScan->setInterval( 510 );
-	pBLEScan->setWindow( 200 );
-	pBLEScan->setActiveScan( true );
-	pBLEScan->setMaxResults( 0xFF );
-	pBLEScan->start( 0, false, true );
-
-	Serial.println( "Application started" );
+	LOG_INFO( "HTTP server started" );
+	Metrics.BootPhaseReached( BOOT_HTTP_STARTED );
 
 	uint8_t mac[ 6 ];
 	WiFi.macAddress( mac );
 	sprintf( macAddress, "%0.2x:%0.2x:%0.2x:%0.2x:%0.2x:%0.2x", mac[ 5 ], mac[ 4 ], mac[ 3 ], mac[ 2 ], mac[ 1 ], mac[ 0 ] );
 
+	Ownership.Begin( macAddress );
 	if ( udp.listenMulticast( IPAddress( 239, 1, 2, 3 ), 1234 ) )
 	{
-		Serial.print( "UDP Listening on IP: " );
-		Serial.println( WiFi.localIP() );
+		LOG_INFO( "UDP Listening on IP: %s", WiFi.localIP().toString().c_str() );
 		udp.onPacket( []( AsyncUDPPacket packet )
-					  {
-                // Serial.println();
-                // Serial.print( "UDP Packet: " );
-                // Serial.printf( ", Data (len %i): ", packet.length() );
-                // Serial.write( packet.data(), packet.length() );
-                // Serial.println();
-                // Serial.println();
-                if (strncmp( (char*)packet.data(), "Are you there SwitchBot?", packet.length() ) == 0)
-                {
-                    Serial.println( "Received: Are you there SwitchBot?" );
-                    sendBroadcast = millis();
-                } } );
+					  { HandleMulticast( packet ); } );
 	}
 
+	Tasks.Start( TASK_CALLBACK, CallbackTask, nullptr );
+	Tasks.Start( TASK_EVENT, EventTask, nullptr );
+	Tasks.Start( TASK_FORWARD, ForwardTask, nullptr );
+	// Housekeeping changes the scan settings so it has to wait for the scan to be running
+	xEventGroupWaitBits( HubEvents, HUB_EVT_BLE_READY, pdFALSE, pdTRUE, portMAX_DELAY );
+	Tasks.Start( TASK_HOUSEKEEPING, HousekeepingTask, nullptr );
+
+	LOG_INFO( "Application started" );
+	Metrics.BootPhaseReached( BOOT_SETUP_DONE );
+
 }	 // End of setup.
 
+// Discovery requests and the peer hubs' reports. The packet isn't NUL terminated so it is copied first.
+void HandleMulticast( AsyncUDPPacket& packet )
+{
+	// Only the UDP task uses the buffer
+	static char text[ DISCOVERY_SIZE ];
+	if ( ( packet.length() == 0 ) || ( packet.length() >= sizeof( text ) ) )
+	{
+		return;
+	}
+	memcpy( text, packet.data(), packet.length() );
+	text[ packet.length() ] = 0;
+
+	// Some senders end the line
+	for ( int i = packet.length() - 1; ( i >= 0 ) && ( ( text[ i ] == '\n' ) || ( text[ i ] == '\r' ) ); i-- )
+	{
+		text[ i ] = 0;
+	}
 
-// This is the Arduino main loop function.
-void loop()
+	if ( strcmp( text, DISCOVERY_QUERY_V2 ) == 0 )
+	{
+		char reply[ DISCOVERY_SIZE ];
+		int bytes = DiscoveryReply( reply, sizeof( reply ) );
+		packet.write( ( uint8_t* ) reply, bytes );
+		LOG_DEBUG( "Discovery reply sent to %s", packet.remoteIP().toString().c_str() );
+	}
+	else if ( strcmp( text, DISCOVERY_QUERY ) == 0 )
+	{
+		LOG_INFO( "Received: Are you there SwitchBot?" );
+		sendBroadcast = millis();
+	}
+	else if ( electDeviceOwners )
+	{
+		Ownership.HandleReport( text, ( uint32_t ) packet.remoteIP(), millis() );
+	}
+}
+
+// The version 1 announcement followed by the hub's capacity and load, so a controller can spread its commands and
+// callbacks over the hubs
+int DiscoveryReply( char* Buf, int BufSize )
 {
-	for ( ;; )
+	int bytes = snprintf( Buf, BufSize,
+						  "SwitchBot BLE Hub! %s {\"protocol\":2,\"firmware\":\"%s\",\"hubMAC\":\"%s\",\"bootId\":\"%08x\",\"uptime\":%lu,"
+						  "\"devices\":%i,\"maxDevices\":%i,\"queued\":%i,\"freeSlots\":%i,\"slots\":%i,"
+						  "\"heapFree\":%u,\"largestBlock\":%u,\"memoryStage\":%i,\"callbacks\":%s,\"peers\":%i}",
+						  macAddress, firmwareVersion, macAddress, BootId, millis() / 1000,
+						  BLE_Devices.GetNumberOfDevices(), MAX_DEVICES, BLECommandQ.GetNumberQueued(), MAX_BLE_CONNECTIONS - CommandsInProgress(), MAX_BLE_CONNECTIONS,
+						  esp_get_free_heap_size(), heap_caps_get_largest_free_block( MALLOC_CAP_8BIT ), Memory.GetStage(),
+						  OurCallbacks.HasCallbacks() ? "true" : "false", electDeviceOwners ? Ownership.GetLivePeers( millis() ) : 0 );
+
+	return ( bytes < BufSize ) ? bytes : BufSize - 1;
+}
+
+// Brings up BLE, the command workers and the scan without waiting for Wi-Fi. The adverts go into the device table
+// while Wi-Fi is still connecting.
+void StartBLETask( void* param )
+{
+	BLEDevice::init( "" );
+	ble_gap_event_listener_register( &gapEventListener, onGapEvent, nullptr );
+	GattHandles.Begin( persistGattHandles );
+	Metrics.BootPhaseReached( BOOT_BLE_READY );
+
+	// Start the command workers
+	ConnectMutex = xSemaphoreCreateMutex();
+	for ( uint8_t i = 0; i < MAX_BLE_CONNECTIONS; i++ )
 	{
-		if ( RebootRequired )
-		{
-			// Allow watchdog to restart the CPU
-			Serial.println( "Waiting for WD to reset system" );
+		memset( &CommandSlots[ i ], 0, sizeof( COMMAND_SLOT ) );
+		CommandSlots[ i ].events = xEventGroupCreate();
+		xTaskCreatePinnedToCore( CommandWorker, "BLECommand", Tasks.GetStackSize( TASK_WORKER ), &CommandSlots[ i ], Tasks.GetPriority( TASK_WORKER ), &CommandSlots[ i ].task, Tasks.GetCore( TASK_WORKER ) );
+	}
+	Tasks.Start( TASK_COMMAND, CommandTask, nullptr );
 
-			cli();                  // Clear interrupts
+	// Retrieve a Scanner and set the callback we want to use to be informed when we
+	// have detected a new device.  Specify that we want active scanning and start the
+	// scan to run for 5 seconds.
+	BLEScan* pBLEScan = BLEDevice::getScan();
+	pBLEScan->setScanCallbacks( new MyAdvertisedDeviceCallbacks(), true );
+	ScanSchedule.Begin( selectiveActiveScan );
+	SCAN_SETTINGS scanSettings = ScanSchedule.GetSettings();
+	pBLEScan->setInterval( scanSettings.interval );
+	pBLEScan->setWindow( scanSettings.window );
+	pBLEScan->setActiveScan( scanSettings.active );
+	pBLEScan->setMaxResults( 0 );	 // Don't keep the results, the commands connect using the address in BLE_Devices
+	pBLEScan->start( 0, false, true );
 
-			esp_task_wdt_config_t wdt_config;
-			wdt_config.timeout_ms = 15;
-			wdt_config.idle_core_mask = 0xFFFFFFFF;
-			wdt_config.trigger_panic = true;
+	LOG_INFO( "BLE scan started" );
+	Metrics.BootPhaseReached( BOOT_SCAN_STARTED );
+	xEventGroupSetBits( HubEvents, HUB_EVT_BLE_READY );
+	vTaskDelete( nullptr );
+}
 
-			esp_task_wdt_init(&wdt_config);
-			esp_task_wdt_add(NULL);
-			while ( true );
-		}
 
-		if ( millis() >= sendBroadcast )
+// Everything runs in the hub's own tasks
+void loop()
+{
+	vTaskDelete( nullptr );
+}	 // End of loop
+
+// Adds the adverts from the scan to the device table
+void IngestTask( void* param )
+{
+	ADVERT advert;
+
+	for ( ;; )
+	{
+		if ( xQueueReceive( AdvertQueue, &advert, pdMS_TO_TICKS( ingestIdleInterval ) ) != pdTRUE )
 		{
-			// Send multicast
-			// Serial.printf( "\n***Broadcasting my details: %s, %s***\n", macAddress, WiFi.localIP().toString().c_str() );
-			udp.printf( "SwitchBot BLE Hub! %s", macAddress );
-			sendBroadcast = millis() + 60000;
+			BLE_Devices.SaveIfDue( millis(), false );
+			continue;
+		}
+		int64_t start = Tasks.Working( TASK_INGEST );
 
-			Serial.printf( "BLE updates %i per minute\n", NumUpdates);
-			NumUpdates = 0;
+		// Keep the state of an event device before the advert so its transitions can be journalled. The state of a
+		// device restored at boot is from before the reboot, so its first advert is not compared with it.
+		bool isEvent = ( advert.serviceDataLen > 0 ) && IsEventModel( advert.serviceData[ 0 ] );
+		int index	 = isEvent ? BLE_Devices.FindDevice( advert.MAC ) : -1;
+		SWITCHBOT before;
+		bool hadBefore = ( index >= 0 ) && !BLE_Devices.IsStale( index ) && BLE_Devices.GetSWDevice( index, before );
 
-			// Report heap available
-			uint32_t freeHeap		  = esp_get_free_heap_size();
-			uint32_t largestHeapBlock = esp_get_minimum_free_heap_size();
-			Serial.printf( "\nFree Heap %i, Largest block %i\n\n", freeHeap, largestHeapBlock );
-			if (largestHeapBlock < 30000)
+		AdvertResult result = BLE_Devices.AddDevice( advert.MAC, advert.addrType, advert.rssi, advert.serviceData, advert.serviceDataLen, advert.manufacturerData, advert.manufacturerDataLen );
+		Metrics.SwitchBotAdvert( advert.serviceDataLen ? advert.serviceData[ 0 ] : 0, result );
+
+		SWITCHBOT after;
+		if ( hadBefore && ( result == ADVERT_CHANGED ) && BLE_Devices.GetSWDevice( index, after ) )
+		{
+			DEVICE_EVENT events[ MAX_DEVICE_EVENTS ];
+			int numEvents = FindDeviceEvents( before, after, events );
+			if ( numEvents > 0 )
 			{
-				Serial.println( "Low heap, rebooting" );
-				RebootRequired = true;
+				Journal.Record( index, advert.MAC, after.model, events, numEvents, millis() );
 			}
 		}
 
-		if (millis() >= BLESending)
-    {
-      // Check if there is a BLE command to send
-      BLE_COMMAND BLECommand;
-      if ( BLECommandQ.Pop( &BLECommand ) )
-      {
-        digitalWrite( led, 1 );
-        WriteToBLEDevice( &BLECommand );
-        digitalWrite( led, 0 );
-      }
-    }
-
-		if ( BLE_Devices.HasChanged() )
+		if ( ( result == ADVERT_ADDED ) || ( result == ADVERT_CHANGED ) )
 		{
-			static char outstr[ 50 ];
+			xEventGroupSetBits( HubEvents, isEvent ? HUB_EVT_EVENT_CHANGED : HUB_EVT_DEVICE_CHANGED );
+		}
 
-			if ( OurCallbacks.HasCallbacks() )
+		if ( ( result != ADVERT_INVALID ) && ( result != ADVERT_NO_ROOM ) )
+		{
+			NumUpdates++;
+			Metrics.BootPhaseReached( BOOT_FIRST_DEVICE );
+			int device = BLE_Devices.FindDevice( advert.MAC );
+			ScanSchedule.Advert( device, advert.serviceData[ 0 ], advert.manufacturerDataLen > 0, millis() );
+			if ( device >= 0 )
 			{
-				SendChangedDevices();
+				Ownership.Advert( device, advert.MAC, advert.rssi, millis() );
 			}
 		}
 
-		OurCallbacks.Check( millis() );	   // Check if any of the registered callbacks have timedout
-	}									   // end of endless loop ;-)
+		// Only this task changes the device table so it saves it too, except the forced save before a reboot
+		BLE_Devices.SaveIfDue( millis(), false );
 
-}	 // End of loop
+		Tasks.Done( TASK_INGEST, start );
+	}
+}
 
-int SendDeviceChange( const char* host, const char* data, int bytes )
+// Hands queued commands to the free workers and drops the ones that have waited too long
+void CommandTask( void* param )
 {
-	// host = "192.168.1.1", ip or dns
+	for ( ;; )
+	{
+		xEventGroupWaitBits( HubEvents, HUB_EVT_COMMAND, pdTRUE, pdFALSE, pdMS_TO_TICKS( NextCommandTimeout() ) );
+		int64_t start = Tasks.Working( TASK_COMMAND );
 
-	Serial.printf( "Connecting to %s to send %s\n", host, data );
+		ExpireCommands();
+		ExpireReplyWaiters();
+		DispatchCommands();
 
-	WiFiClient client;
-	HTTPClient http;
+		Tasks.Done( TASK_COMMAND, start );
+	}
+}
 
-	// configure target server and url
-	http.begin( client, host );	   // HTTP
-	http.addHeader( "Content-Type", "application/json" );
-	http.setReuse( false );
+// Time (ms) until a queued command can go to a worker that is resting after its last command
+unsigned long NextCommandTimeout()
+{
+	unsigned long t		  = millis();
+	unsigned long timeout = commandCheckInterval;
+
+	if ( BLECommandQ.GetNumberQueued() > 0 )
+	{
+		for ( uint8_t i = 0; i < MAX_BLE_CONNECTIONS; i++ )
+		{
+			if ( !CommandSlots[ i ].busy && ( CommandSlots[ i ].readyTime > t ) && ( ( CommandSlots[ i ].readyTime - t ) < timeout ) )
+			{
+				timeout = CommandSlots[ i ].readyTime - t;
+			}
+		}
+	}
+
+	return timeout;
+}
+
+int CommandsInProgress()
+{
+	int busy = 0;
+	for ( uint8_t i = 0; i < MAX_BLE_CONNECTIONS; i++ )
+	{
+		if ( CommandSlots[ i ].busy )
+		{
+			busy++;
+		}
+	}
+
+	return busy;
+}
+
+// The interval and window can only be changed while the scan is stopped. That would upset a worker that is
+// connecting, so the change waits for the next check. Returns false if it has to be tried again.
+bool ApplyScanSettings()
+{
+	if ( xSemaphoreTake( ConnectMutex, 0 ) != pdTRUE )
+	{
+		return false;
+	}
+
+	SCAN_SETTINGS settings = ScanSchedule.GetSettings();
+	BLEScan* pBLEScan	   = BLEDevice::getScan();
+
+	pBLEScan->stop();
+	pBLEScan->setInterval( settings.interval );
+	pBLEScan->setWindow( settings.window );
+	pBLEScan->setActiveScan( settings.active );
+	bool started = pBLEScan->start( 0, false, true );
+
+	xSemaphoreGive( ConnectMutex );
+
+	if ( !started )
+	{
+		LOG_ERROR( "Failed to restart the scan" );
+	}
+
+	return started;
+}
+
+// Sends device changes and failed commands to the callbacks. The POSTs can take seconds so they get their own task.
+void CallbackTask( void* param )
+{
+	for ( ;; )
+	{
+		xEventGroupWaitBits( HubEvents, HUB_EVT_DEVICE_CHANGED | HUB_EVT_COMMAND_FAILED, pdTRUE, pdFALSE, pdMS_TO_TICKS( callbackCheckInterval ) );
+		int64_t start = Tasks.Working( TASK_CALLBACK );
+
+		SendFailedCommands();
+
+		if ( BLE_Devices.HasChanged() && OurCallbacks.HasCallbacks() && CallbackAllowed() )
+		{
+			SendChangedDevices();
+		}
+
+		OurCallbacks.Check( millis() );	   // Check if any of the registered callbacks have timedout
+
+		Tasks.Done( TASK_CALLBACK, start );
+	}
+}
+
+// Sends event device changes on their own as soon as they happen, so they don't wait behind the other devices
+void EventTask( void* param )
+{
+	for ( ;; )
+	{
+		// Events that couldn't be delivered are retried after a while
+		bool retry = OurCallbacks.HasCallbacks() && BLE_Devices.HasEventChange();
+		xEventGroupWaitBits( HubEvents, HUB_EVT_EVENT_CHANGED, pdTRUE, pdFALSE, retry ? pdMS_TO_TICKS( eventRetryInterval ) : portMAX_DELAY );
+		int64_t start = Tasks.Working( TASK_EVENT );
+
+		while ( OurCallbacks.HasCallbacks() && BLE_Devices.HasEventChange() && SendChangedEvents() )
+		{
+		}
+
+		Tasks.Done( TASK_EVENT, start );
+	}
+}
+
+void HousekeepingTask( void* param )
+{
+	bool scanSettingsPending = false;	 // The schedule changed but a connect was in progress
+
+	for ( ;; )
+	{
+		vTaskDelay( pdMS_TO_TICKS( memoryCheckInterval ) );
+		int64_t start = Tasks.Working( TASK_HOUSEKEEPING );
+
+		if ( RebootRequired )
+		{
+			// Allow watchdog to restart the CPU
+			LOG_INFO( "Waiting for WD to reset system" );
+			BLE_Devices.SaveIfDue( millis(), true );
+			HubLog.Flush();	   // The drain task won't run again once interrupts are off
+
+			cli();                  // Clear interrupts
+
+			esp_task_wdt_config_t wdt_config;
+			wdt_config.timeout_ms = 15;
+			wdt_config.idle_core_mask = 0xFFFFFFFF;
+			wdt_config.trigger_panic = true;
+
+			esp_task_wdt_init(&wdt_config);
+			esp_task_wdt_add(NULL);
+			while ( true );
+		}
+
+		if ( millis() >= sendBroadcast )
+		{
+			// Send multicast
+			// Serial.printf( "\n***Broadcasting my details: %s, %s***\n", macAddress, WiFi.localIP().toString().c_str() );
+			udp.printf( "SwitchBot BLE Hub! %s", macAddress );
+			sendBroadcast = millis() + 60000;
+
+			LOG_INFO( "BLE updates %i per minute", NumUpdates);
+			NumUpdates = 0;
+
+			// Report heap available
+			uint32_t freeHeap		  = esp_get_free_heap_size();
+			uint32_t largestHeapBlock = heap_caps_get_largest_free_block( MALLOC_CAP_8BIT );
+			LOG_INFO( "Free Heap %i, Largest block %i", freeHeap, largestHeapBlock );
+		}
+
+		// Tell the other hubs how well we hear each device and decide which ones we report
+		if ( electDeviceOwners && ( millis() >= sendPeerReport ) )
+		{
+			// Send the current state of the devices we took over
+			uint8_t taken[ MAX_DEVICES ];
+			int numTaken = Ownership.Elect( millis(), taken );
+			for ( int i = 0; i < numTaken; i++ )
+			{
+				BLE_Devices.MarkChanged( taken[ i ] );
+			}
+
+			if ( numTaken > 0 )
+			{
+				xEventGroupSetBits( HubEvents, HUB_EVT_DEVICE_CHANGED | HUB_EVT_EVENT_CHANGED );
+			}
+
+			char report[ PEER_REPORT_SIZE ];
+			int bytes = Ownership.BuildReport( report, sizeof( report ), millis() );
+			if ( bytes > 0 )
+			{
+				udp.write( ( uint8_t* ) report, bytes );
+			}
+
+			sendPeerReport = millis() + ( Ownership.GetLivePeers( millis() ) ? peerReportInterval : peerIdleReportInterval );
+		}
+
+		// Scan more or less of the time to suit the devices and commands
+		if ( ScanSchedule.Update( millis(), BLECommandQ.GetNumberQueued() + CommandsInProgress() ) )
+		{
+			scanSettingsPending = true;
+		}
+
+		if ( scanSettingsPending )
+		{
+			scanSettingsPending = !ApplyScanSettings();
+		}
+
+		// Shed load as the heap runs short, reboot only when that hasn't helped
+		Memory.Update( heap_caps_get_largest_free_block( MALLOC_CAP_8BIT ), millis() );
+		if ( Memory.ShouldReboot( millis() ) )
+		{
+			LOG_ERROR( "Low heap, rebooting" );
+			RebootRequired = true;
+		}
+
+		Tasks.Done( TASK_HOUSEKEEPING, start );
+	}
+}
+
+// Under memory pressure device changes are held back so they go in fewer callbacks. The devices stay marked as
+// changed so nothing is lost, only delayed.
+bool CallbackAllowed()
+{
+	static unsigned long nextCallback = 0;
+
+	switch ( Memory.GetStage() )
+	{
+		case MEM_NORMAL:
+			return true;
+
+		case MEM_CONSTRAINED:
+			if ( millis() < nextCallback )
+			{
+				return false;
+			}
+			nextCallback = millis() + callbackBatchTime;
+			return true;
+
+		default:
+			// Only events can't wait and they have their own task
+			return false;
+	}
+}
+
+int SendDeviceChange( const char* host, const char* data, int bytes )
+{
+	// host = "192.168.1.1", ip or dns
+
+	LOG_DEBUG( "Connecting to %s to send %s", host, data );
+
+	WiFiClient client;
+	HTTPClient http;
+
+	// configure target server and url
+	http.begin( client, host );	   // HTTP
+	http.addHeader( "Content-Type", "application/json" );
+	http.setReuse( false );
 
 	// start connection and send HTTP header
-	int httpCode = http.POST( ( uint8_t* ) data, bytes );
+	unsigned long start = millis();
+	int httpCode		= http.POST( ( uint8_t* ) data, bytes );
+	Metrics.CallbackPost( ( httpCode > 0 ) && ( httpCode < 400 ), millis() - start );
+	if ( ( httpCode > 0 ) && ( httpCode < 400 ) )
+	{
+		Metrics.BootPhaseReached( BOOT_FIRST_CALLBACK );
+	}
+
+	// httpCode will be negative on error
+	if ( httpCode > 0 )
+	{
+		// HTTP header has been send and Server response header has been handled
+		LOG_INFO( "[HTTP] POST response code: %d", httpCode );
+	}
+	else
+	{
+		LOG_ERROR( "[HTTP] POST failed, code %i, error: %s", httpCode, http.errorToString( httpCode ).c_str() );
+	}
+
+	http.end();
+
+	return httpCode;
+}
+
+// Sends the devices to every callback. The caller borrows addresBuf (256 bytes) before it takes the changes so a
+// failed borrow can't lose them. Returns true if at least one callback accepted them.
+bool SendToCallbacks( const char* deviceBuf, int bytes, char* addresBuf )
+{
+	bool accepted = false;
+	for ( uint8_t i = 0; OurCallbacks.Get( i, addresBuf, 255 ); i++ )
+	{
+		int httpCode = SendDeviceChange( addresBuf, deviceBuf, bytes );
+		if ( httpCode == -1 )
+		{
+			// refused connection
+			OurCallbacks.addRefusal( addresBuf );
+		}
+		else
+		{
+			OurCallbacks.resetRefusal( addresBuf );
+		}
+
+		accepted |= ( httpCode > 0 ) && ( httpCode < 400 );
+	}
+
+	return accepted;
+}
+
+bool IsReportedHere( uint8_t Index )
+{
+	return Ownership.IsOwner( Index );
+}
+
+void SendChangedDevices()
+{
+	// This object changed so send to registered callbacks
+	char* deviceBuf = Buffers.Borrow( 2048 );
+	char* addresBuf = Buffers.Borrow( 256 );
+	if ( deviceBuf && addresBuf )
+	{
+		int bytes = BLE_Devices.AllToJson( deviceBuf, 2048, true, macAddress, electDeviceOwners ? IsReportedHere : nullptr );
+		if ( bytes > 0 )
+		{
+			SendToCallbacks( deviceBuf, bytes, addresBuf );
+		}
+	}
+	else
+	{
+		// The devices stay marked as changed so they are sent next time
+		LOG_ERROR( "Failed to allocate buffer for device JSON" );
+	}
+
+	Buffers.Return( addresBuf );
+	Buffers.Return( deviceBuf );
+}
+
+// Sends a few of the changed event devices, each with an "events" array of its transitions since the last time.
+// The transitions only count as delivered once a callback accepts them, otherwise the devices are put back to be
+// sent again. Returns false if nothing could be sent.
+bool SendChangedEvents()
+{
+	char* deviceBuf = Buffers.Borrow( 4096 );
+	char* addresBuf = Buffers.Borrow( 256 );
+	if ( ( deviceBuf == nullptr ) || ( addresBuf == nullptr ) )
+	{
+		LOG_ERROR( "Failed to allocate buffer for event JSON" );
+		Buffers.Return( addresBuf );
+		Buffers.Return( deviceBuf );
+		return false;
+	}
+
+	uint8_t indexes[ EVENTS_PER_CALLBACK ];
+	uint32_t last[ EVENTS_PER_CALLBACK ];
+	bool included[ EVENTS_PER_CALLBACK ];
+	unsigned long oldest;
+	int numDevices = BLE_Devices.TakeChangedEvents( indexes, EVENTS_PER_CALLBACK, &oldest );
+
+	int bytes = 1;
+	int added = 0;
+	deviceBuf[ 0 ] = '[';
+	for ( int i = 0; i < numDevices; i++ )
+	{
+		last[ i ]	  = 0;
+		included[ i ] = false;
+
+		// Another hub sends this device's events
+		if ( electDeviceOwners && !Ownership.IsOwner( indexes[ i ] ) )
+		{
+			Journal.MarkDelivered( indexes[ i ], Journal.GetSeq() );
+			continue;
+		}
+
+		// Open the device object up again to add its events
+		int deviceBytes = BLE_Devices.DeviceToJson( indexes[ i ], deviceBuf + bytes, 4096 - bytes, macAddress );
+		if ( ( deviceBytes < 2 ) || ( deviceBytes >= ( 4096 - bytes - 32 ) ) )
+		{
+			// The rest go next time
+			LOG_ERROR( "No room for event device %i", indexes[ i ] );
+			for ( int j = i; j < numDevices; j++ )
+			{
+				BLE_Devices.MarkChanged( indexes[ j ] );
+			}
+			numDevices = i;
+			break;
+		}
+		bytes += deviceBytes - 1;
+		bytes += snprintf( deviceBuf + bytes, 4096 - bytes, ",\"events\":" );
+		bytes += Journal.UndeliveredToJson( indexes[ i ], deviceBuf + bytes, 4096 - bytes - 3, &last[ i ] );
+		bytes += snprintf( deviceBuf + bytes, 4096 - bytes, "}," );
+		included[ i ] = true;
+		added++;
+	}
+	deviceBuf[ bytes - 1 ] = ']';
+	deviceBuf[ bytes ]	   = 0;
+
+	bool delivered = true;
+	if ( added > 0 )
+	{
+		delivered = SendToCallbacks( deviceBuf, bytes, addresBuf );
+		for ( int i = 0; i < numDevices; i++ )
+		{
+			if ( !included[ i ] )
+			{
+				continue;
+			}
+
+			// A device can be in the POST for its new state without a new journal entry, it is retried all the same
+			if ( delivered )
+			{
+				Journal.MarkDelivered( indexes[ i ], last[ i ] );
+			}
+			else
+			{
+				BLE_Devices.MarkChanged( indexes[ i ] );
+			}
+		}
+
+		if ( delivered )
+		{
+			Metrics.EventDelivered( millis() - oldest );
+		}
+		else
+		{
+			LOG_WARN( "No callback accepted the events, retrying" );
+		}
+	}
+
+	Buffers.Return( addresBuf );
+	Buffers.Return( deviceBuf );
+	return delivered && ( numDevices > 0 );
+}
+
+// Add a chunk of a request body to the buffer for that request. Returns the buffer once the whole body has arrived,
+// otherwise nullptr. Bodies that don't fit or can't be buffered are answered here.
+BODY_BUFFER* CollectBody( AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total )
+{
+	BODY_BUFFER* body = nullptr;
+
+	if ( index == 0 )
+	{
+		if ( total > BODY_BUFFER_SIZE )
+		{
+			request->send( 413, "text/plain", "Payload Too Large" );
+			return nullptr;
+		}
+
+		unsigned long t = millis();
+		for ( int i = 0; i < BODY_BUFFERS; i++ )
+		{
+			if ( ( BodyBuffers[ i ].request == nullptr ) || ( BodyBuffers[ i ].request == request ) ||
+				 ( ( t - BodyBuffers[ i ].claimed ) > bodyBufferTimeout ) )
+			{
+				body		  = &BodyBuffers[ i ];
+				body->request = request;
+				body->claimed = t;
+				body->length  = 0;
+				break;
+			}
+		}
+
+		if ( body == nullptr )
+		{
+			request->send( 503, "text/plain", "Service Unavailable" );
+			return nullptr;
+		}
+	}
+	else
+	{
+		for ( int i = 0; i < BODY_BUFFERS; i++ )
+		{
+			if ( BodyBuffers[ i ].request == request )
+			{
+				body = &BodyBuffers[ i ];
+				break;
+			}
+		}
+
+		if ( body == nullptr )
+		{
+			return nullptr;	   // Already answered
+		}
+	}
+
+	if ( ( index != body->length ) || ( ( index + len ) > total ) )
+	{
+		ReleaseBody( body );
+		request->send( 400, "text/plain", "Bad Request" );
+		return nullptr;
+	}
+
+	memcpy( body->data + index, data, len );
+	body->length += len;
+	if ( body->length < total )
+	{
+		return nullptr;
+	}
+
+	body->data[ body->length ] = 0;
+	return body;
+}
+
+void ReleaseBody( BODY_BUFFER* body )
+{
+	body->request = nullptr;
+}
+
+// The reply address of a command is the IP address of the client that sent it
+// The client's address, or for a write forwarded by another hub the address of the client that sent it there
+void GetRemoteIP( AsyncWebServerRequest* request, char* buf, int bufSize )
+{
+	IPAddress ip = request->client()->remoteIP();
+
+	// Only a peer hub can say who the reply is for, anyone else could send our replies to another host
+	const AsyncWebHeader* replyTo = request->hasHeader( FORWARDED_HEADER ) ? request->getHeader( REPLY_TO_HEADER ) : nullptr;
+	if ( ( replyTo != nullptr ) && ( replyTo->value().length() > 0 ) && ( replyTo->value().length() < ( unsigned ) bufSize ) )
+	{
+		if ( electDeviceOwners && Ownership.IsPeer( ( uint32_t ) ip, millis() ) )
+		{
+			strlcpy( buf, replyTo->value().c_str(), bufSize );
+			return;
+		}
+
+		LOG_WARN( "Ignoring %s from %u.%u.%u.%u, it isn't a peer hub", REPLY_TO_HEADER, ip[ 0 ], ip[ 1 ], ip[ 2 ], ip[ 3 ] );
+	}
+
+	snprintf( buf, bufSize, "%u.%u.%u.%u", ip[ 0 ], ip[ 1 ], ip[ 2 ], ip[ 3 ] );
+}
+
+// Decode a write request ({address, data, priority, timeout}) straight into a command. The data is either an array
+// of bytes or a string of them ("[87,1,0]"). Returns false if the request isn't valid.
+bool BuildCommand( JsonObject writeParameters, const char* replyTo, BLE_COMMAND* command )
+{
+	uint8_t data[ sizeof( command->Data ) ];
+	int dataLen = -1;
+
+	JsonVariant dataToWrite = writeParameters[ "data" ];
+	if ( dataToWrite.is< JsonArray >() )
+	{
+		JsonArray bytes = dataToWrite.as< JsonArray >();
+		if ( bytes.size() <= sizeof( data ) )
+		{
+			for ( dataLen = 0; dataLen < ( int ) bytes.size(); dataLen++ )
+			{
+				int value = bytes[ dataLen ].as< int >();
+				if ( ( value < 0 ) || ( value > 255 ) )
+				{
+					return false;
+				}
+				data[ dataLen ] = value;
+			}
+		}
+	}
+	else
+	{
+		dataLen = CommandQ::ParseData( dataToWrite.as< const char* >(), data, sizeof( data ) );
+	}
+
+	unsigned long timeout = writeParameters[ "timeout" ].as< unsigned long >();
+	if ( timeout == 0 )
+	{
+		timeout = defaultCommandTimeout;
+	}
+
+	return CommandQ::Build( writeParameters[ "address" ], data, dataLen, replyTo, ParsePriority( writeParameters[ "priority" ] ), timeout, command );
+}
+
+// Convert the optional "priority" of a write request. Without one the priority is set from the command data.
+uint8_t ParsePriority( const char* priority )
+{
+	if ( priority == nullptr )
+	{
+		return CMD_PRIORITY_DEFAULT;
+	}
+
+	if ( strcmp( priority, "automation" ) == 0 )
+	{
+		return CMD_PRIORITY_AUTOMATION;
+	}
+
+	if ( strcmp( priority, "query" ) == 0 )
+	{
+		return CMD_PRIORITY_QUERY;
+	}
+
+	return CMD_PRIORITY_USER;
+}
+
+// Write to several devices with one request. The body is an array of write requests ({address, data, priority,
+// timeout}). Either all the commands are queued or none of them, the reply has the status of each command.
+void HandleBatchWrite( AsyncWebServerRequest* request, char* data, size_t length )
+{
+	// Static as the body handlers all run on the web server task
+	static StaticJsonDocument< 4096 > jsonDoc;
+	static BLE_COMMAND commands[ MAX_BATCH ];
+
+	if ( DeserializationError::Ok != deserializeJson( jsonDoc, data, length ) )
+	{
+		request->send( 400, "text/plain", "Bad Request" );
+		return;
+	}
+
+	JsonArray writeRequests = jsonDoc.as< JsonArray >();
+	if ( ( writeRequests.size() == 0 ) || ( writeRequests.size() > MAX_BATCH ) )
+	{
+		request->send( 400, "text/plain", "Bad Request" );
+		return;
+	}
+
+	const char* status[ MAX_BATCH ];
+	CommandQResult results[ MAX_BATCH ];
+	char sourceIP[ 16 ];
+	int numCommands = 0;
+	bool valid		= true;
+
+	GetRemoteIP( request, sourceIP, sizeof( sourceIP ) );
+
+	// Check all the commands before queuing any
+	for ( JsonObject writeParameters : writeRequests )
+	{
+		const char* clientAddress = writeParameters[ "address" ];
+		status[ numCommands ]	  = "ok";
+
+		if ( !BuildCommand( writeParameters, sourceIP, &commands[ numCommands ] ) )
+		{
+			status[ numCommands ] = "bad request";
+			valid				  = false;
+		}
+		else if ( BLE_Devices.FindDevice( clientAddress ) < 0 )
+		{
+			status[ numCommands ] = "unknown device";
+			valid				  = false;
+		}
+
+		numCommands++;
+	}
+
+	int httpCode = 422;
+	if ( valid )
+	{
+		httpCode = BLECommandQ.PushBatch( commands, numCommands, results ) ? 200 : 429;
+		xEventGroupSetBits( HubEvents, HUB_EVT_COMMAND );
+		for ( int i = 0; i < numCommands; i++ )
+		{
+			status[ i ] = ( results[ i ] == CMDQ_QUEUED ) ? "queued" : ( results[ i ] == CMDQ_REPLACED ) ? "replaced" : "queue full";
+		}
+	}
+	else
+	{
+		for ( int i = 0; i < numCommands; i++ )
+		{
+			if ( strcmp( status[ i ], "ok" ) == 0 )
+			{
+				status[ i ] = "not queued";
+			}
+		}
+	}
+
+	LOG_INFO( "Received batch of %i commands from %s: %i", numCommands, sourceIP, httpCode );
+
+	// Reply with the status of each command in the same order as the request
+	char* replyBuf = Buffers.Borrow( 2048 );
+	if ( replyBuf )
+	{
+		int bytes = snprintf( replyBuf, 2048, "[" );
+		for ( int i = 0; i < numCommands; i++ )
+		{
+			bytes += snprintf( replyBuf + bytes, 2048 - bytes, "%s{\"address\":\"%s\",\"status\":\"%s\"}", ( i > 0 ) ? "," : "", commands[ i ].Address, status[ i ] );
+		}
+		snprintf( replyBuf + bytes, 2048 - bytes, "]" );
+
+		request->send( httpCode, "application/json", replyBuf );
+		Buffers.Return( replyBuf );
+	}
+	else
+	{
+		LOG_ERROR( "Failed to allocate buf for JSON" );
+		request->send( httpCode, "text/plain", ( httpCode == 200 ) ? "OK" : "Not queued" );
+	}
+}
+
+// Drop the commands that have waited too long and let the caller know
+void ExpireCommands()
+{
+	BLE_COMMAND expired[ 4 ];
+	int numExpired;
+
+	while ( ( numExpired = BLECommandQ.Expire( millis(), expired, 4 ) ) > 0 )
+	{
+		for ( int i = 0; i < numExpired; i++ )
+		{
+			LOG_WARN( "Command for %s expired", expired[ i ].Address );
+			SendCommandFailed( &expired[ i ], "Command expired", 504 );
+		}
+	}
+}
+
+// The error reply for a command that wasn't sent, returns its length
+int CommandFailedToJson( const BLE_COMMAND* BLECommand, const char* reason, char* replyBuf, int bufSize )
+{
+	int bytes = snprintf( replyBuf, bufSize, "[{\"hubMAC\":\"%s\",\"address\":\"%s\",\"error\":\"%s\",\"data\":[",
+						  macAddress, BLECommand->Address, reason );
+
+	for ( int i = 0; i < BLECommand->DataLen; i++ )
+	{
+		bytes += snprintf( replyBuf + bytes, bufSize - bytes, "%i,", BLECommand->Data[ i ] );
+	}
+
+	bytes--;
+	bytes += snprintf( replyBuf + bytes, bufSize - bytes, "]}]" );
+	return bytes;
+}
+
+void SendCommandFailed( BLE_COMMAND* BLECommand, const char* reason, int httpCode )
+{
+	char replyBuf[ 200 ];
+	CommandFailedToJson( BLECommand, reason, replyBuf, sizeof( replyBuf ) );
+
+	// Whoever is waiting for the command gets the error, otherwise it goes to the callback
+	if ( AnswerReplyWaiters( BLECommand->Seq, httpCode, replyBuf ) > 0 )
+	{
+		return;
+	}
+
+	FAILED_COMMAND failed;
+	failed.command = *BLECommand;
+	failed.reason  = reason;
+	if ( xQueueSend( FailedQueue, &failed, 0 ) == pdTRUE )
+	{
+		xEventGroupSetBits( HubEvents, HUB_EVT_COMMAND_FAILED );
+	}
+	else
+	{
+		LOG_WARN( "Too many failed commands, %s not reported", BLECommand->Address );
+	}
+}
+
+// Tell the callbacks about the commands SendCommandFailed queued, on the callback task
+void SendFailedCommands()
+{
+	FAILED_COMMAND failed;
+	while ( xQueueReceive( FailedQueue, &failed, 0 ) == pdTRUE )
+	{
+		char replyBuf[ 200 ];
+		int bytes = CommandFailedToJson( &failed.command, failed.reason, replyBuf, sizeof( replyBuf ) );
+
+		char replyAddress[ 255 ];
+		if ( OurCallbacks.Find( failed.command.ReplyTo, replyAddress, sizeof( replyAddress ) ) )
+		{
+			SendDeviceChange( replyAddress, replyBuf, bytes );
+		}
+	}
+}
+
+// Queue a command and, if asked, pause the request until the command completes. The waiter is added while holding
+// the mutex so a command that fails straight away can't complete before anyone is waiting for it.
+CommandQResult QueueCommand( AsyncWebServerRequest* request, const BLE_COMMAND* Command, bool Wait, bool* Waiting )
+{
+	uint32_t seq;
+
+	*Waiting = false;
+	xSemaphoreTake( WaitersMutex, portMAX_DELAY );
+	CommandQResult result = BLECommandQ.Push( Command, &seq );
+	xEventGroupSetBits( HubEvents, HUB_EVT_COMMAND );
+	if ( Wait && ( result != CMDQ_FULL ) )
+	{
+		for ( int i = 0; i < MAX_REPLY_WAITERS; i++ )
+		{
+			if ( !ReplyWaiters[ i ].active )
+			{
+				ReplyWaiters[ i ].request  = request->pause();
+				ReplyWaiters[ i ].seq	   = seq;
+				ReplyWaiters[ i ].deadline = Command->Deadline + replyWaitMargin;
+				ReplyWaiters[ i ].active   = true;
+				*Waiting				   = true;
+				break;
+			}
+		}
+
+		// No free waiter so answer now and the reply goes to the callback as usual
+	}
+	xSemaphoreGive( WaitersMutex );
+
+	return result;
+}
+
+// Send the response to every request waiting for that command. A replaced command answers the requests of the
+// commands it replaced. Returns the number of requests answered.
+int AnswerReplyWaiters( uint32_t seq, int httpCode, const char* body )
+{
+	int answered = 0;
+
+	xSemaphoreTake( WaitersMutex, portMAX_DELAY );
+	for ( int i = 0; i < MAX_REPLY_WAITERS; i++ )
+	{
+		if ( ReplyWaiters[ i ].active && ( ReplyWaiters[ i ].seq == seq ) )
+		{
+			// The client may have gone away while the command was running
+			if ( auto request = ReplyWaiters[ i ].request.lock() )
+			{
+				request->send( httpCode, "application/json", body );
+				answered++;
+			}
+
+			ReplyWaiters[ i ].request.reset();
+			ReplyWaiters[ i ].active = false;
+		}
+	}
+	xSemaphoreGive( WaitersMutex );
+
+	return answered;
+}
 
-	// httpCode will be negative on error
-	if ( httpCode > 0 )
+// Hand the write to the forward task if a peer hub sees the device. Returns false if it can't be forwarded.
+bool ForwardCommand( AsyncWebServerRequest* request, const char* Address, const char* ReplyTo, bool Wait, const char* Body, size_t Length )
+{
+	uint32_t ip;
+	char peerMAC[ 18 ];
+	if ( !electDeviceOwners || request->hasHeader( FORWARDED_HEADER ) || ( Length >= FORWARD_BODY_SIZE ) ||
+		 !Ownership.FindBestPeer( Address, millis(), &ip, peerMAC ) )
 	{
-		// HTTP header has been send and Server response header has been handled
-		Serial.printf( "[HTTP] POST response code: %d\n", httpCode );
+		return false;
 	}
-	else
+
+	bool queued = false;
+	xSemaphoreTake( ForwardsMutex, portMAX_DELAY );
+	for ( int i = 0; i < MAX_FORWARDS; i++ )
+	{
+		if ( !Forwards[ i ].active )
+		{
+			Forwards[ i ].request = request->pause();
+			Forwards[ i ].ip	  = ip;
+			Forwards[ i ].wait	  = Wait;
+			Forwards[ i ].length  = Length;
+			memcpy( Forwards[ i ].body, Body, Length );
+			strlcpy( Forwards[ i ].peerMAC, peerMAC, sizeof( Forwards[ i ].peerMAC ) );
+			strlcpy( Forwards[ i ].replyTo, ReplyTo, sizeof( Forwards[ i ].replyTo ) );
+			Forwards[ i ].active = true;
+			queued				 = true;
+			break;
+		}
+	}
+	xSemaphoreGive( ForwardsMutex );
+
+	if ( queued )
+	{
+		xEventGroupSetBits( HubEvents, HUB_EVT_FORWARD );
+	}
+
+	return queued;
+}
+
+// POST the write to the peer and pass its reply back on the original request
+void SendForward( FORWARD* Forward )
+{
+	char url[ 64 ];
+	uint32_t ip = Forward->ip;
+	snprintf( url, sizeof( url ), "http://%u.%u.%u.%u/api/v1/device/write%s", ip & 0xFF, ( ip >> 8 ) & 0xFF, ( ip >> 16 ) & 0xFF, ip >> 24, Forward->wait ? "?wait=1" : "" );
+
+	WiFiClient client;
+	HTTPClient http;
+	http.begin( client, url );
+	http.addHeader( "Content-Type", "application/json" );
+	http.addHeader( FORWARDED_HEADER, macAddress );
+	http.addHeader( REPLY_TO_HEADER, Forward->replyTo );
+	const char* replyHeaders[] = { "Content-Type" };
+	http.collectHeaders( replyHeaders, 1 );
+	http.setReuse( false );
+	http.setTimeout( Forward->wait ? forwardWaitTimeout : forwardTimeout );
+
+	int httpCode = http.POST( ( uint8_t* ) Forward->body, Forward->length );
+	ForwardsSent++;
+	LOG_INFO( "Forwarded write to %s: %i", Forward->peerMAC, httpCode );
+
+	if ( auto request = Forward->request.lock() )
+	{
+		AsyncWebServerResponse* response;
+		if ( httpCode > 0 )
+		{
+			String reply = http.getString();
+			String type	 = http.header( "Content-Type" );
+			response	 = request->beginResponse( httpCode, type.length() ? type.c_str() : "text/plain", reply.c_str() );
+		}
+		else
+		{
+			ForwardsFailed++;
+			response = request->beginResponse( 502, "text/plain", "Bad Gateway" );
+		}
+
+		response->addHeader( "X-SwitchBot-Forwarded-To", Forward->peerMAC );
+		request->send( response );
+	}
+	else if ( httpCode <= 0 )
 	{
-		Serial.printf( "[HTTP] POST failed, code %i, error: %s\n", httpCode, http.errorToString( httpCode ).c_str() );
+		ForwardsFailed++;
 	}
 
 	http.end();
+}
 
-	return httpCode;
+// Forwards the writes one at a time, a slow peer only holds up the other forwards
+void ForwardTask( void* param )
+{
+	for ( ;; )
+	{
+		xEventGroupWaitBits( HubEvents, HUB_EVT_FORWARD, pdTRUE, pdFALSE, portMAX_DELAY );
+		int64_t start = Tasks.Working( TASK_FORWARD );
+
+		for ( int i = 0; i < MAX_FORWARDS; i++ )
+		{
+			if ( Forwards[ i ].active )
+			{
+				SendForward( &Forwards[ i ] );
+
+				xSemaphoreTake( ForwardsMutex, portMAX_DELAY );
+				Forwards[ i ].request.reset();
+				Forwards[ i ].active = false;
+				xSemaphoreGive( ForwardsMutex );
+			}
+		}
+
+		Tasks.Done( TASK_FORWARD, start );
+	}
 }
 
-void SendChangedDevices()
+// Tell anyone waiting for the command whether it was sent
+void AnswerCommandWaiters( BLE_COMMAND* BLECommand, bool success )
 {
-	// This object changed so send to registered callbacks
-	char* deviceBuf = ( char* ) malloc( 2048 );
-	if ( deviceBuf )
+	char body[ 100 ];
+	snprintf( body, sizeof( body ), "{\"hubMAC\":\"%s\",\"address\":\"%s\",\"status\":\"%s\"}",
+			  macAddress, BLECommand->Address, success ? "sent" : "failed" );
+	AnswerReplyWaiters( BLECommand->Seq, success ? 200 : 502, body );
+}
+
+// Answer any waiting request that has run out of time
+void ExpireReplyWaiters()
+{
+	unsigned long t = millis();
+
+	xSemaphoreTake( WaitersMutex, portMAX_DELAY );
+	for ( int i = 0; i < MAX_REPLY_WAITERS; i++ )
+	{
+		if ( ReplyWaiters[ i ].active && ( ( long ) ( t - ReplyWaiters[ i ].deadline ) >= 0 ) )
+		{
+			if ( auto request = ReplyWaiters[ i ].request.lock() )
+			{
+				request->send( 504, "text/plain", "Gateway Timeout" );
+			}
+
+			ReplyWaiters[ i ].request.reset();
+			ReplyWaiters[ i ].active = false;
+		}
+	}
+	xSemaphoreGive( WaitersMutex );
+}
+
+// Returns true if a command for that device is already being sent. Used to keep the commands to one device in order.
+bool IsDeviceBusy( const char* Address )
+{
+	for ( uint8_t i = 0; i < MAX_BLE_CONNECTIONS; i++ )
+	{
+		if ( CommandSlots[ i ].busy && ( strcasecmp( CommandSlots[ i ].command.Address, Address ) == 0 ) )
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void DispatchCommands()
+{
+	for ( uint8_t i = 0; i < MAX_BLE_CONNECTIONS; i++ )
+	{
+		COMMAND_SLOT* slot = &CommandSlots[ i ];
+		if ( slot->busy || ( millis() < slot->readyTime ) )
+		{
+			continue;
+		}
+
+		if ( !BLECommandQ.Pop( &slot->command, IsDeviceBusy ) )
+		{
+			// Nothing to send to a device that isn't busy
+			break;
+		}
+
+		memset( slot->times, 0, sizeof( slot->times ) );
+		slot->times[ TS_ENQUEUED ] = slot->command.Enqueued;
+		slot->times[ TS_DEQUEUED ] = millis();
+		slot->retries			   = 0;
+
+		slot->busy = true;
+		xEventGroupSetBits( slot->events, CMD_EVT_START );
+	}
+}
+
+void CommandWorker( void* param )
+{
+	COMMAND_SLOT* slot = ( COMMAND_SLOT* ) param;
+
+	for ( ;; )
+	{
+		xEventGroupWaitBits( slot->events, CMD_EVT_START, pdTRUE, pdFALSE, portMAX_DELAY );
+		if ( !slot->busy )
+		{
+			continue;
+		}
+
+		int64_t start = Tasks.Working( TASK_WORKER );
+
+		digitalWrite( led, 1 );
+		WriteToBLEDevice( slot );
+		digitalWrite( led, 0 );
+		Tasks.Done( TASK_WORKER, start );
+
+		// Give the scan some time before this slot sends the next command
+		slot->readyTime = millis() + 1000;
+		slot->busy		= false;
+		xEventGroupSetBits( HubEvents, HUB_EVT_COMMAND );
+	}
+}
+
+COMMAND_SLOT* FindSlot( NimBLEClient* pBLEClient )
+{
+	for ( uint8_t i = 0; i < MAX_BLE_CONNECTIONS; i++ )
+	{
+		if ( CommandSlots[ i ].busy && ( CommandSlots[ i ].client == pBLEClient ) )
+		{
+			return &CommandSlots[ i ];
+		}
+	}
+
+	return nullptr;
+}
+
+class CommandClientCallbacks : public NimBLEClientCallbacks
+{
+	void onConnect( NimBLEClient* pClient ) override
+	{
+		COMMAND_SLOT* slot = FindSlot( pClient );
+		if ( slot )
+		{
+			xEventGroupSetBits( slot->events, CMD_EVT_CONNECTED );
+		}
+	}
+
+	void onConnectFail( NimBLEClient* pClient, int reason ) override
+	{
+		COMMAND_SLOT* slot = FindSlot( pClient );
+		if ( slot )
+		{
+			xEventGroupSetBits( slot->events, CMD_EVT_CONNECT_FAILED );
+		}
+	}
+
+	void onDisconnect( NimBLEClient* pClient, int reason ) override
+	{
+		COMMAND_SLOT* slot = FindSlot( pClient );
+		if ( slot )
+		{
+			xEventGroupSetBits( slot->events, CMD_EVT_DISCONNECTED );
+		}
+	}
+};
+
+static CommandClientCallbacks commandClientCallbacks;
+
+static int onCCCDWritten( uint16_t conn_handle, const struct ble_gatt_error* error, struct ble_gatt_attr* attr, void* arg )
+{
+	COMMAND_SLOT* slot = ( COMMAND_SLOT* ) arg;
+	slot->cccdStatus   = error->status;
+	xEventGroupSetBits( slot->events, CMD_EVT_CCCD_WRITTEN );
+	return 0;
+}
+
+static int onCommandWritten( uint16_t conn_handle, const struct ble_gatt_error* error, struct ble_gatt_attr* attr, void* arg )
+{
+	COMMAND_SLOT* slot = ( COMMAND_SLOT* ) arg;
+	slot->writeStatus  = error->status;
+	xEventGroupSetBits( slot->events, CMD_EVT_WRITTEN );
+	return 0;
+}
+
+// Wait for one of the requested events. Returns 0 on timeout.
+EventBits_t WaitCommandEvent( COMMAND_SLOT* slot, EventBits_t bits, uint32_t timeout )
+{
+	return xEventGroupWaitBits( slot->events, bits, pdTRUE, pdFALSE, pdMS_TO_TICKS( timeout ) ) & bits;
+}
+
+// Discover the service and characteristics and keep the handles for the next time
+bool DiscoverHandles( COMMAND_SLOT* slot, bool needsNotify )
+{
+	BLERemoteService* rs = slot->client->getService( serviceUUID );
+	if ( rs == nullptr )
+	{
+		LOG_ERROR( "Failed to get service" );
+		return false;
+	}
+
+	LOG_INFO( "Got remote service" );
+
+	BLERemoteCharacteristic* rc = rs->getCharacteristic( charUUID );
+	if ( rc == nullptr )
+	{
+		LOG_ERROR( "Failed to get characteristic" );
+		return false;
+	}
+
+	LOG_INFO( "Got remote characteristic" );
+
+	memset( &slot->handles, 0, sizeof( GATT_HANDLES ) );
+	slot->handles.model		  = slot->model;
+	slot->handles.writeHandle = rc->getHandle();
+
+	if ( needsNotify )
+	{
+		// This request requires data to be return via the notification
+		BLERemoteCharacteristic* rn = rs->getCharacteristic( notifyUUID );
+		NimBLERemoteDescriptor* cccd = rn ? rn->getDescriptor( NimBLEUUID( ( uint16_t ) 0x2902 ) ) : nullptr;
+		if ( cccd == nullptr )
+		{
+			LOG_ERROR( "Failed to get notification characteristic" );
+			return false;
+		}
+
+		slot->handles.notifyHandle = rn->getHandle();
+		slot->handles.notifyCCCD   = cccd->getHandle();
+	}
+
+	GattHandles.Put( slot->handles );
+	return true;
+}
+
+void SendNotifyReply( COMMAND_SLOT* slot, char model )
+{
+	BLE_COMMAND* BLECommand = &slot->command;
+
+	// Return data
+	char* replyBuf = Buffers.Borrow( 300 );
+	if ( replyBuf )
 	{
-		int bytes = BLE_Devices.AllToJson( deviceBuf, 2048, true, macAddress );
+		int bytes = 0;
+
+		if ( model == 'u' )
+		{
+			bytes = snprintf( replyBuf, 300, "[{\"hubMAC\":\"%s\",\"address\":\"%s\",\"serviceData\":{\"model\":\"u\",\"modelName\":\"WoBulb\"},\"replyData\":[",
+							  macAddress, BLECommand->Address );
+		}
+		else if ( model == 'x' )
+		{
+			bytes = snprintf( replyBuf, 300, "[{\"hubMAC\":\"%s\",\"address\":\"%s\",\"serviceData\":{\"model\":\"x\",\"modelName\":\"WoBlindTilt\"},\"replyData\":[",
+							  macAddress, BLECommand->Address );
+		}
+
 		if ( bytes > 0 )
 		{
+			// Convert raw data to JsonArray
+			for ( int i = 0; i < slot->notifyLength; i++ )
+			{
+				bytes += snprintf( replyBuf + bytes, 300 - bytes, "%i,", slot->notifyData[ i ] );
+			}
 
-			char* addresBuf = ( char* ) malloc( 256 );
-			if ( addresBuf )
+			bytes--;
+			bytes += snprintf( replyBuf + bytes, 300 - bytes, "]}]" );
+
+			char* replyAddress = nullptr;
+			if ( AnswerReplyWaiters( BLECommand->Seq, 200, replyBuf ) > 0 )
+			{
+				// The reply went back on the write request
+			}
+			else if ( ( replyAddress = Buffers.Borrow( 300 ) ) != nullptr )
 			{
-				uint8_t i = 0;
-				while ( OurCallbacks.Get( i++, addresBuf, 255 ) )
+				if ( OurCallbacks.Find( BLECommand->ReplyTo, replyAddress, 300 ) )
 				{
-					if ( SendDeviceChange( addresBuf, deviceBuf, bytes ) == -1 )
-					{
-						// refused connection
-						OurCallbacks.addRefusal( i );
-					}
-					else
-					{
-						OurCallbacks.resetRefusal( i );
-					}
+					// Serial.printf( "Sending to %s: %s\n", replyAddress, replyBuf );
+					SendDeviceChange( replyAddress, replyBuf, bytes );
+				}
+				else
+				{
+					LOG_WARN( "Callback URL %s not found", BLECommand->ReplyTo );
 				}
 
-				free( addresBuf );
+				Buffers.Return( replyAddress );
 			}
 			else
 			{
-				Serial.println( "Failed to allocate buffer for address buffer" );
-				RebootRequired = true;
+				LOG_ERROR( "Failed to allocate buf for reply address" );
 			}
 		}
+		else
+		{
+			LOG_WARN( "Don't understand format for model %c", model );
+		}
+
+		Buffers.Return( replyBuf );
 	}
 	else
 	{
-		Serial.println( "Failed to allocate buffer for device JSON" );
-		RebootRequired = true;
+		LOG_ERROR( "Failed to allocate buf for reply buffer" );
 	}
-
-	free( deviceBuf );
 }
 
-void WriteToBLEDevice( BLE_COMMAND* BLECommand )
+// Send a command as a sequence of states. Each state starts a radio operation and waits for the event from the
+// NimBLE host, so the worker sleeps while the radio is busy instead of polling.
+void WriteToBLEDevice( COMMAND_SLOT* slot )
 {
-	BLEScan* pBLEScan = BLEDevice::getScan();
+	BLE_COMMAND* BLECommand = &slot->command;
+	BLEScan* pBLEScan		= BLEDevice::getScan();
 
-	const BLEAddress bleAddress( BLECommand->Address, 0 );
-	Serial.printf( "Sending command to BLE device: %s\n", BLECommand->Address );
-  uint64_t requestAddress = bleAddress;
+	LOG_INFO( "Sending command to BLE device: %s", BLECommand->Address );
 
-	NimBLEScanResults results = pBLEScan->getResults();
-  uint8_t numResults = results.getCount();
-  const NimBLEAdvertisedDevice* pDevice = nullptr;
-  for (int i = 0; i < numResults; i++)
-  {
-  	pDevice = results.getDevice( i );
+	// The device table has the address type and the model (which selects the cached GATT handles)
+	int deviceIdx = BLE_Devices.FindDevice( BLECommand->Address );
+	SWITCHBOT Device;
+	if ( ( deviceIdx < 0 ) || !BLE_Devices.GetSWDevice( deviceIdx, Device ) )
+	{
+		LOG_WARN( "Device not found" );
+		slot->times[ TS_DONE ] = millis();
+		CommandStatistics.Record( deviceIdx, 0, slot->times, 0, false );
+		AnswerCommandWaiters( BLECommand, false );
+		return;
+	}
 
-    uint64_t deviceAddress = pDevice->getAddress();
-    if (deviceAddress == requestAddress)
-    {
-      break;
-    }
+	const NimBLEAddress bleAddress( std::string( BLECommand->Address ), BLE_Devices.GetAddressType( deviceIdx ) );
+	slot->model = Device.model;
 
-  }
+	bool needsNotify = IsQueryCommand( BLECommand );
+	bool useCache	 = true;
+	bool complete	 = false;
+	int retries		 = 5;
 
-	// Get the device (might be null if not found)
-//	const NimBLEAdvertisedDevice* pDevice = results.getDevice( bleAddress );
+	// The device was found so create a clinet to connect to it
+	NimBLEClient* pBLEClient = NimBLEDevice::createClient();
+	pBLEClient->setConnectionParams( 32, 160, 0, 500 );
+	pBLEClient->setClientCallbacks( &commandClientCallbacks, false );
+	slot->client = pBLEClient;
+	xEventGroupClearBits( slot->events, CMD_EVT_ALL );
 
-	if ( pDevice != nullptr )
+	slot->state = CMD_CONNECTING;
+	while ( slot->state != CMD_DONE )
 	{
-		// The device was found so create a clinet to connect to it
-		NimBLEClient* pBLEClient = NimBLEDevice::createClient();
-		pBLEClient->setConnectionParams( 32, 160, 0, 500 );
-
-		bool complete = false;
-		int retries	  = 5;
-
-		while ( !complete && ( retries-- > 0 ) )
+		switch ( slot->state )
 		{
-			// Serial.println( "Connecting to device..." );
-			if ( pBLEClient->connect( pDevice ) )
+			case CMD_CONNECTING:
 			{
-				// success
-				Serial.println( "Device connected" );
+				if ( retries-- <= 0 )
+				{
+					slot->state = CMD_DONE;
+					break;
+				}
 
-				BLERemoteService* rs = pBLEClient->getService( serviceUUID );
-				if ( rs != nullptr )
+				if ( retries < 4 )
 				{
-					Serial.println( "Got remote service" );
+					slot->retries++;
+				}
 
-					BLERemoteCharacteristic* rc = rs->getCharacteristic( charUUID );
-					if ( rs != nullptr )
+				// Serial.println( "Connecting to device..." );
+				xEventGroupClearBits( slot->events, CMD_EVT_ALL );
+				xSemaphoreTake( ConnectMutex, portMAX_DELAY );
+				EventBits_t events = 0;
+				if ( pBLEClient->connect( bleAddress, true, true ) )
+				{
+					events = WaitCommandEvent( slot, CMD_EVT_CONNECTED | CMD_EVT_CONNECT_FAILED, 30000 );
+					if ( events == 0 )
 					{
-						Serial.println( "Got remote characteristic" );
+						pBLEClient->cancelConnect();
+					}
+				}
+				xSemaphoreGive( ConnectMutex );
 
-						// Get the notification characteristic
-						BLERemoteCharacteristic* rn = nullptr;
-						if ( ( ( BLECommand->Data[ 0 ] == 87 ) && ( BLECommand->Data[ 1 ] == 15 ) && ( BLECommand->Data[ 2 ] == 72 ) && ( BLECommand->Data[ 3 ] == 1 ) ) ||
-							 ( BLECommand->Data[ 0 ] == 87 ) && ( BLECommand->Data[ 1 ] == 2 ) )
-						{
-							// This request requires data to be return via the notification
-							// Serial.println( "Getting notification characteristic" );
-							rn = rs->getCharacteristic( notifyUUID );
+				if ( events & CMD_EVT_CONNECTED )
+				{
+					// success
+					LOG_INFO( "Device connected" );
+					slot->times[ TS_CONNECTED ] = millis();
+					slot->state					= CMD_DISCOVERING;
+				}
+				else
+				{
+					LOG_ERROR( "Failed to connected to device" );
+				}
+				break;
+			}
 
-							if ( rn )
-							{
-								// Serial.println( "Registering notification" );
-								BLENotifyLength = 0;
-								if ( !rn->subscribe( true, notifyCallback ) )
-								{
-									Serial.println( "Registering notification FAILED!" );
-								}
-							}
-						}
+			case CMD_DISCOVERING:
+			{
+				if ( useCache && ( slot->model != 0 ) && GattHandles.Get( slot->model, slot->handles ) &&
+					 ( !needsNotify || ( slot->handles.notifyCCCD != 0 ) ) )
+				{
+					// Skip the discovery
+					slot->times[ TS_DISCOVERED ] = millis();
+					slot->state					 = needsNotify ? CMD_SUBSCRIBING : CMD_WRITING;
+				}
+				else if ( DiscoverHandles( slot, needsNotify ) )
+				{
+					useCache					 = false;
+					slot->times[ TS_DISCOVERED ] = millis();
+					slot->state					 = needsNotify ? CMD_SUBSCRIBING : CMD_WRITING;
+				}
+				else
+				{
+					slot->state = CMD_DISCONNECTING;
+				}
+				break;
+			}
 
-						rc->writeValue( BLECommand->Data, BLECommand->DataLen );
-						Serial.println( "Data sent" );
+			case CMD_SUBSCRIBING:
+			{
+				// Enable the notification by writing to the client characteristic configuration descriptor
+				static const uint8_t enableNotify[ 2 ] = { 0x01, 0x00 };
 
-						if ( rn )
-						{
-							Serial.println( "Waiting for notification" );
-							unsigned long endTime = millis() + 2000;
-							while ( ( BLENotifyLength == 0 ) && ( millis() < endTime ) )
-								;
-							if ( BLENotifyLength > 0 )
-							{
-								Serial.println( "Got notification" );
-
-								// Return data
-								char* replyBuf = ( char* ) malloc( 300 );
-								if ( replyBuf )
-								{
-									int idx = BLE_Devices.FindDevice( BLECommand->Address );
-									SWITCHBOT Device;
-									if ( BLE_Devices.GetSWDevice( idx, Device ) )
-									{
-										int bytes = 0;
-
-										if ( Device.model == 'u' )
-										{
-											bytes = snprintf( replyBuf, 300, "[{\"hubMAC\":\"%s\",\"address\":\"%s\",\"serviceData\":{\"model\":\"u\",\"modelName\":\"WoBulb\"},\"replyData\":[",
-															  macAddress, BLECommand->Address );
-										}
-										else if ( Device.model == 'x' )
-										{
-											bytes = snprintf( replyBuf, 300, "[{\"hubMAC\":\"%s\",\"address\":\"%s\",\"serviceData\":{\"model\":\"x\",\"modelName\":\"WoBlindTilt\"},\"replyData\":[",
-															  macAddress, BLECommand->Address );
-										}
-
-										if ( bytes > 0 )
-										{
-											// Convert raw data to JsonArray
-											for ( int i = 0; i < BLENotifyLength; i++ )
-											{
-												bytes += snprintf( replyBuf + bytes, 300 - bytes, "%i,", BLENotifyData[ i ] );
-											}
-
-											bytes--;
-											bytes += snprintf( replyBuf + bytes, 300 - bytes, "]}]" );
-
-											char* replyAddress = ( char* ) malloc( 300 );
-											if ( replyAddress )
-											{
-												if ( OurCallbacks.Find( BLECommand->ReplyTo, replyAddress, 300 ) )
-												{
-													// Serial.printf( "Sending to %s: %s\n", replyAddress, replyBuf );
-													SendDeviceChange( replyAddress, replyBuf, bytes );
-												}
-												else
-												{
-													Serial.printf( "Callback URL %s not found\n", BLECommand->ReplyTo );
-												}
-
-												free( replyAddress );
-											}
-											else
-											{
-												Serial.println( "Failed to allocate buf for reply address" );
-												RebootRequired = true;
-											}
-										}
-										else
-										{
-											Serial.printf( "Don't understand format for model %c\n", Device.model );
-										}
-									}
-									else
-									{
-										Serial.printf( "Callback URL %s not found\n", BLECommand->ReplyTo );
-									}
-
-									free( replyBuf );
-								}
-								else
-								{
-									Serial.println( "Failed to allocate buf for reply buffer" );
-									RebootRequired = true;
-								}
-							}
+				slot->notifyLength	   = 0;
+				slot->notifyConnHandle = pBLEClient->getConnHandle();
+				slot->notifyAttrHandle = slot->handles.notifyHandle;
 
-							rn->unsubscribe();
-						}
-						complete = true;
-					}
-					else
-					{
-						Serial.println( "Failed to get characteristic" );
-					}
+				xEventGroupClearBits( slot->events, CMD_EVT_CCCD_WRITTEN | CMD_EVT_NOTIFY );
+				if ( ( ble_gattc_write_flat( slot->notifyConnHandle, slot->handles.notifyCCCD, enableNotify, sizeof( enableNotify ), onCCCDWritten, slot ) == 0 ) &&
+					 ( WaitCommandEvent( slot, CMD_EVT_CCCD_WRITTEN | CMD_EVT_DISCONNECTED, 2000 ) == CMD_EVT_CCCD_WRITTEN ) &&
+					 ( slot->cccdStatus == 0 ) )
+				{
+					slot->state = CMD_WRITING;
+				}
+				else
+				{
+					LOG_ERROR( "Registering notification FAILED!" );
+					slot->state = CMD_CACHE_FAILED;
+				}
+				break;
+			}
+
+			case CMD_WRITING:
+			{
+				// A write without response only fails locally, so a cached handle is written with a response to find
+				// out whether it is still the right attribute
+				bool written;
+				if ( useCache )
+				{
+					xEventGroupClearBits( slot->events, CMD_EVT_WRITTEN );
+					written = ( ble_gattc_write_flat( pBLEClient->getConnHandle(), slot->handles.writeHandle, BLECommand->Data, BLECommand->DataLen, onCommandWritten, slot ) == 0 ) &&
+							  ( WaitCommandEvent( slot, CMD_EVT_WRITTEN | CMD_EVT_DISCONNECTED, 2000 ) == CMD_EVT_WRITTEN ) &&
+							  ( slot->writeStatus == 0 );
+				}
+				else
+				{
+					written = ble_gattc_write_no_rsp_flat( pBLEClient->getConnHandle(), slot->handles.writeHandle, BLECommand->Data, BLECommand->DataLen ) == 0;
+				}
+
+				if ( written )
+				{
+					LOG_INFO( "Data sent" );
+					slot->times[ TS_WRITTEN ] = millis();
+					complete				  = true;
+					slot->state = needsNotify ? CMD_AWAIT_NOTIFY : CMD_DISCONNECTING;
 				}
 				else
 				{
-					Serial.println( "Failed to get service" );
+					slot->state = CMD_CACHE_FAILED;
 				}
+				break;
+			}
 
-				pBLEClient->disconnect();
-				Serial.println( "Disconnected device" );
+			case CMD_CACHE_FAILED:
+			{
+				if ( useCache )
+				{
+					// The attribute table may have changed (e.g. firmware update) so fall back to discovery
+					LOG_WARN( "Cached handles failed, discovering" );
+					GattHandles.Invalidate( slot->model );
+					useCache	= false;
+					slot->state = pBLEClient->isConnected() ? CMD_DISCOVERING : CMD_CONNECTING;
+				}
+				else
+				{
+					slot->state = CMD_DISCONNECTING;
+				}
+				break;
 			}
-			else
+
+			case CMD_AWAIT_NOTIFY:
 			{
-				Serial.println( "Failed to connected to device" );
+				LOG_INFO( "Waiting for notification" );
+				if ( WaitCommandEvent( slot, CMD_EVT_NOTIFY | CMD_EVT_DISCONNECTED, 2000 ) & CMD_EVT_NOTIFY )
+				{
+					LOG_INFO( "Got notification" );
+					slot->times[ TS_NOTIFIED ] = millis();
+					slot->state				   = CMD_REPLYING;
+				}
+				else
+				{
+					slot->state = CMD_DISCONNECTING;
+				}
+				break;
 			}
-		}
 
-		NimBLEDevice::deleteClient( pBLEClient );
-	}
-	else
-	{
-		Serial.println( "Device not found" );
+			case CMD_REPLYING:
+			{
+				SendNotifyReply( slot, slot->model );
+				slot->times[ TS_REPLIED ] = millis();
+				slot->state				  = CMD_DISCONNECTING;
+				break;
+			}
+
+			case CMD_DISCONNECTING:
+			{
+				slot->notifyAttrHandle = 0;
+				if ( pBLEClient->isConnected() )
+				{
+					pBLEClient->disconnect();
+					WaitCommandEvent( slot, CMD_EVT_DISCONNECTED, 2000 );
+					LOG_INFO( "Disconnected device" );
+				}
+
+				slot->state = complete ? CMD_DONE : CMD_CONNECTING;
+				break;
+			}
+
+			default:
+				slot->state = CMD_DONE;
+		}
 	}
 
-	Serial.println( "Restarting BLE scan" );
+	slot->client = nullptr;
+	NimBLEDevice::deleteClient( pBLEClient );
+
+	// A query is only complete when the reply has been sent
+	slot->times[ TS_DONE ] = millis();
+	bool success		   = needsNotify ? ( slot->times[ TS_REPLIED ] != 0 ) : complete;
+	CommandStatistics.Record( deviceIdx, slot->model, slot->times, slot->retries, success );
+
+	// A query that replied has already answered anyone waiting for it
+	AnswerCommandWaiters( BLECommand, success );
+
+	LOG_INFO( "Restarting BLE scan" );
   pBLEScan->start(0, true, false);
-  BLESending = millis() + 1000;
 }